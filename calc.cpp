@@ -1,364 +1,4830 @@
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <iomanip>
+#include <sstream>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
-#include <cctype>
+#include <unordered_set>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
-// Functor used to encrypt pairs.
-struct pair_hash {
-    template <class T1, class T2>
-    std::size_t operator() (const std::pair<T1,T2> &p) const {
-        auto h1 = std::hash<T1>{}(p.first);
-        auto h2 = std::hash<T2>{}(p.second);
+/**
+ * @class ErrorCode
+ * The class lists all the errors an expression can fail with.
+ */
+enum class ErrorCode : uint8_t {
+    NONE = 0,
+    BAD_SYMBOL,
+    INVALID_BRACKETS,
+    INVALID_FORMAT,
+    DIVISION_BY_ZERO,
+    ROMAN_OVERFLOW,
+    NON_CANONICAL_NUMERAL,
+    UNDEFINED_NAME,
+    CIRCULAR_REFERENCE,
+    FRAME_TOO_LARGE
+};
+
+/**
+ * @class CalcError
+ * Exception thrown by the converter and the solver. Keeps the machine-readable error code
+ * next to the human-readable message.
+ * 
+ * Methods:
+ * ErrorCode code() // returns error's code.
+ * int position() // returns 1-based position of the bad symbol or numeral, 0 for the other errors.
+ */
+class CalcError : public std::logic_error {
+public:
+    CalcError(ErrorCode code, const std::string &message, int position = 0)
+        : std::logic_error(message), code_(code), position_(position) {}
+
+    ErrorCode code() const {
+        return code_;
+    }
+
+    int position() const {
+        return position_;
+    }
+
+private:
+    ErrorCode code_;
+    int position_;
+};
+
+/**
+ * @class Stage
+ * The class lists the instrumented stages of solving an expression.
+ */
+enum class Stage {
+    TOKENIZE,
+    SHUNTING_YARD,
+    SOLVE,
+    TO_ROMAN,
+    TOTAL,
+    COUNT
+};
+
+/**
+ * @class LatencyHistogram
+ * HDR-style histogram of latencies in nanoseconds: every power of two is split into
+ * 2^SUB_BITS linear sub-buckets, so any recorded value is kept with ~3% relative error.
+ * 
+ * Methods:
+ * void record(uint64_t value) // adds a value to the histogram.
+ * uint64_t percentile(double p) // returns an upper bound of the p-th percentile.
+ * uint64_t count() // returns the number of recorded values.
+ */
+class LatencyHistogram {
+private:
+    static const int SUB_BITS = 5;
+    static const int SUB_COUNT = 1 << SUB_BITS;
+    static const int BUCKET_COUNT = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+    std::vector<uint64_t> buckets_ = std::vector<uint64_t>(BUCKET_COUNT, 0);
+    uint64_t count_ = 0, sum_ = 0, min_ = UINT64_MAX, max_ = 0;
+
+    static int bucket_of(uint64_t value) {
+        if (value < SUB_COUNT) {
+            return value;
+        }
+        int exponent = 63 - __builtin_clzll(value);
+        int sub = (value >> (exponent - SUB_BITS)) & (SUB_COUNT - 1);
+        return (exponent - SUB_BITS + 1) * SUB_COUNT + sub;
+    }
+
+    static uint64_t upper_bound_of(int bucket) {
+        if (bucket < SUB_COUNT) {
+            return bucket;
+        }
+        int exponent = bucket / SUB_COUNT + SUB_BITS - 1;
+        uint64_t sub = bucket % SUB_COUNT + SUB_COUNT;
+        return ((sub + 1) << (exponent - SUB_BITS)) - 1;
+    }
+public:
+    void record(uint64_t value) {
+        buckets_[bucket_of(value)]++;
+        count_++;
+        sum_ += value;
+        min_ = std::min(min_, value);
+        max_ = std::max(max_, value);
+    }
+
+    uint64_t percentile(double p) const {
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(p / 100.0 * count_ + 0.5));
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKET_COUNT; i++) {
+            seen += buckets_[i];
+            if (seen >= rank) {
+                return std::min(upper_bound_of(i), max_);
+            }
+        }
+        return max_;
+    }
+
+    uint64_t count() const {
+        return count_;
+    }
+
+    uint64_t min() const {
+        return count_ ? min_ : 0;
+    }
+
+    uint64_t max() const {
+        return max_;
+    }
+
+    uint64_t mean() const {
+        return count_ ? sum_ / count_ : 0;
+    }
+};
+
+/**
+ * @class AllocationCounter
+ * Per-thread counters of heap allocations, fed by the replaced global operator new.
+ */
+struct AllocationCounter {
+    static thread_local uint64_t allocations;
+    static thread_local uint64_t bytes;
+};
+
+thread_local uint64_t AllocationCounter::allocations = 0;
+thread_local uint64_t AllocationCounter::bytes = 0;
+
+void* operator new(std::size_t size) {
+    AllocationCounter::allocations++;
+    AllocationCounter::bytes += size;
+    if (void* pointer = std::malloc(size ? size : 1)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+// Kept out of line: once inlined into a caller GCC flags free() on a pointer from operator new.
+__attribute__((noinline)) void operator delete(void* pointer) noexcept {
+    std::free(pointer);
+}
+
+__attribute__((noinline)) void operator delete(void* pointer, std::size_t) noexcept {
+    std::free(pointer);
+}
+
+/**
+ * @class Probe
+ * A sample of the instrumented counters: monotonic time and heap allocations so far.
+ * The difference of two samples is the cost of the code between them.
+ */
+struct Probe {
+    uint64_t time = 0;
+    uint64_t allocations = 0;
+    uint64_t bytes = 0;
+
+    Probe operator-(const Probe &other) const {
+        Probe result;
+        result.time = time - other.time;
+        result.allocations = allocations - other.allocations;
+        result.bytes = bytes - other.bytes;
+        return result;
+    }
+
+    Probe& operator+=(const Probe &other) {
+        time += other.time;
+        allocations += other.allocations;
+        bytes += other.bytes;
+        return *this;
+    }
+};
+
+/**
+ * @class Instrumentation
+ * Process-wide per-stage latency histograms and allocation totals. Both are disabled by
+ * default, so probes cost a single branch; enabled by the --stats and --alloc-stats flags.
+ * 
+ * Methods:
+ * static bool enabled() // checks that any instrumentation is turned on.
+ * static Probe sample() // returns the current counters, zeros for the disabled ones.
+ * static void record(Stage stage, const Probe &cost) // records a stage's cost.
+ * static void dump(std::ostream &out) // prints the tables of all the stages' costs.
+ * static double allocations_per_expression() // returns the mean number of allocations per expression.
+ * static void request_dump(int) // SIGUSR1 handler, asks for a dump at the next dump_if_requested().
+ * static void dump_if_requested(std::ostream &out) // dumps if a dump was requested since the last call.
+ */
+class Instrumentation {
+private:
+    static bool timing_, allocations_;
+    static volatile std::sig_atomic_t dump_requested_;
+    static LatencyHistogram histograms_[static_cast<int>(Stage::COUNT)];
+    static Probe totals_[static_cast<int>(Stage::COUNT)];
+    static std::mutex mutex_; // stages are recorded from the threads of the batch mode too.
+
+    static const char* name(int stage) {
+        static const char* names[] = {"tokenize", "shunting-yard", "solve", "to-roman", "total"};
+        return names[stage];
+    }
+
+    static uint64_t expressions() {
+        return std::max<uint64_t>(1, histograms_[static_cast<int>(Stage::TOTAL)].count());
+    }
+public:
+    static void enable_timing() {
+        timing_ = true;
+    }
+
+    static void enable_allocations() {
+        allocations_ = true;
+    }
+
+    static bool enabled() {
+        return timing_ || allocations_;
+    }
+
+    static Probe sample() {
+        Probe probe;
+        if (!allocations_ && !timing_) {
+            return probe;
+        }
+        if (timing_) {
+            probe.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+        probe.allocations = AllocationCounter::allocations;
+        probe.bytes = AllocationCounter::bytes;
+        return probe;
+    }
+
+    static void record(Stage stage, const Probe &cost) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        histograms_[static_cast<int>(stage)].record(cost.time);
+        totals_[static_cast<int>(stage)] += cost;
+    }
+
+    static double allocations_per_expression() {
+        return static_cast<double>(totals_[static_cast<int>(Stage::TOTAL)].allocations) / expressions();
+    }
+
+    static void dump(std::ostream &out) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (timing_) {
+            out << "stage            count      min      p50      p90      p99    p99.9      max     mean (ns)\n";
+            for (int i = 0; i < static_cast<int>(Stage::COUNT); i++) {
+                const LatencyHistogram &h = histograms_[i];
+                out << std::left << std::setw(14) << name(i) << std::right
+                    << std::setw(8) << h.count() << ' '
+                    << std::setw(8) << h.min() << ' '
+                    << std::setw(8) << h.percentile(50) << ' '
+                    << std::setw(8) << h.percentile(90) << ' '
+                    << std::setw(8) << h.percentile(99) << ' '
+                    << std::setw(8) << h.percentile(99.9) << ' '
+                    << std::setw(8) << h.max() << ' '
+                    << std::setw(8) << h.mean() << '\n';
+            }
+        }
+        if (allocations_) {
+            out << "stage              allocs        bytes  allocs/expr   bytes/expr\n";
+            for (int i = 0; i < static_cast<int>(Stage::COUNT); i++) {
+                const Probe &total = totals_[i];
+                out << std::left << std::setw(14) << name(i) << std::right << std::fixed << std::setprecision(2)
+                    << std::setw(10) << total.allocations << ' '
+                    << std::setw(12) << total.bytes << ' '
+                    << std::setw(12) << static_cast<double>(total.allocations) / expressions() << ' '
+                    << std::setw(12) << static_cast<double>(total.bytes) / expressions() << '\n';
+            }
+        }
+        out.flush();
+    }
+
+    static void request_dump(int) {
+        dump_requested_ = 1;
+    }
+
+    static void dump_if_requested(std::ostream &out) {
+        if (dump_requested_) {
+            dump_requested_ = 0;
+            dump(out);
+        }
+    }
+};
+
+bool Instrumentation::timing_ = false;
+bool Instrumentation::allocations_ = false;
+volatile std::sig_atomic_t Instrumentation::dump_requested_ = 0;
+LatencyHistogram Instrumentation::histograms_[static_cast<int>(Stage::COUNT)];
+Probe Instrumentation::totals_[static_cast<int>(Stage::COUNT)];
+std::mutex Instrumentation::mutex_;
+
+/**
+ * @class StageTimer
+ * Records the cost of the object's lifetime as the cost of a stage.
+ */
+class StageTimer {
+public:
+    StageTimer(Stage stage) : stage_(stage), start_(Instrumentation::sample()) {}
+
+    ~StageTimer() {
+        if (Instrumentation::enabled()) {
+            Instrumentation::record(stage_, Instrumentation::sample() - start_);
+        }
+    }
+
+private:
+    Stage stage_;
+    Probe start_;
+};
+
+/**
+ * @class CharClass
+ * The class lists the classes of characters the lexer tells apart.
+ */
+enum class CharClass : uint8_t {
+    INVALID,
+    SPACE,
+    NUMERAL,
+    OPERATION,
+    OPEN_BRACKET,
+    CLOSE_BRACKET
+};
+
+/**
+ * @class CharTable
+ * 256-entry table classifying every byte, so classifying a character is a single load.
+ * For CharClass::NUMERAL symbol is the numeral's index in "IVXLCDMZ" and value is its value.
+ */
+struct CharTable {
+    struct Entry {
+        CharClass type = CharClass::INVALID;
+        uint8_t symbol = 0;
+        uint16_t value = 0;
+    };
+
+    Entry entries[256];
+
+    constexpr CharTable() : entries() {
+        for (const char c : {' ', '\t', '\n', '\v', '\f', '\r'}) {
+            entries[static_cast<unsigned char>(c)] = {CharClass::SPACE, 0, 0};
+        }
+        for (const char c : {'+', '-', '*', '/'}) {
+            entries[static_cast<unsigned char>(c)] = {CharClass::OPERATION, 0, 0};
+        }
+        entries[static_cast<unsigned char>('(')] = {CharClass::OPEN_BRACKET, 0, 0};
+        entries[static_cast<unsigned char>(')')] = {CharClass::CLOSE_BRACKET, 0, 0};
+        entries[static_cast<unsigned char>('I')] = {CharClass::NUMERAL, 0, 1};
+        entries[static_cast<unsigned char>('V')] = {CharClass::NUMERAL, 1, 5};
+        entries[static_cast<unsigned char>('X')] = {CharClass::NUMERAL, 2, 10};
+        entries[static_cast<unsigned char>('L')] = {CharClass::NUMERAL, 3, 50};
+        entries[static_cast<unsigned char>('C')] = {CharClass::NUMERAL, 4, 100};
+        entries[static_cast<unsigned char>('D')] = {CharClass::NUMERAL, 5, 500};
+        entries[static_cast<unsigned char>('M')] = {CharClass::NUMERAL, 6, 1000};
+        entries[static_cast<unsigned char>('Z')] = {CharClass::NUMERAL, 7, 0};
+    }
+
+    constexpr const Entry& operator[](const char c) const {
+        return entries[static_cast<unsigned char>(c)];
+    }
+};
+
+inline constexpr CharTable char_table;
+
+// Same set of characters as std::isspace in the "C" locale.
+inline bool is_space(const char c) {
+    return char_table[c].type == CharClass::SPACE;
+}
+
+/**
+ * @class NumeralAutomaton
+ * DFA accepting exactly the canonical numerals: M{0,3}(CM|CD|D?C{0,3})(XC|XL|L?X{0,3})(IX|IV|V?I{0,3})
+ * or a lone Z. Every transition also carries the amount it adds to the numeral's value, so
+ * walking the automaton validates and decodes a numeral in the same single pass.
+ * States past START are grouped by decade (thousands, hundreds, tens, units), eight per decade.
+ */
+struct NumeralAutomaton {
+    struct Transition {
+        uint8_t next = 0;
+        int16_t add = 0;
+    };
+
+    static constexpr int REJECT = 0, START = 1, ZERO = 2;
+    static constexpr int DECADES = 4, SUBSTATES = 8, SYMBOLS = 8;
+    static constexpr int STATES = 3 + DECADES * SUBSTATES;
+    enum Substate { ONE, TWO, THREE, FIVE, SIX, SEVEN, EIGHT, DONE };
+
+    // Symbols are indexed as in CharTable: I V X L C D M Z. -1 marks a missing symbol.
+    static constexpr int symbol_value[SYMBOLS] = {1, 5, 10, 50, 100, 500, 1000, 0};
+    static constexpr int one[DECADES] = {6, 4, 2, 0};
+    static constexpr int five[DECADES] = {-1, 5, 3, 1};
+    static constexpr int ten[DECADES] = {-1, 6, 4, 2};
+
+    Transition transitions[STATES][SYMBOLS];
+    bool accepting[STATES];
+
+    static constexpr int state(int decade, int substate) {
+        return 3 + decade * SUBSTATES + substate;
+    }
+
+    constexpr NumeralAutomaton() : transitions(), accepting() {
+        transitions[START][7] = {ZERO, 0};
+        for (int from = START; from < STATES; from++) {
+            if (from == ZERO) {
+                continue;
+            }
+            accepting[from] = from != START;
+            int decade = from == START ? -1 : (from - 3) / SUBSTATES;
+            int substate = from == START ? DONE : (from - 3) % SUBSTATES;
+            for (int symbol = 0; symbol < 7; symbol++) {
+                Transition &transition = transitions[from][symbol];
+                transition.add = symbol_value[symbol];
+                if (decade >= 0 && symbol == one[decade] &&
+                    (substate == ONE || substate == TWO || substate == FIVE || substate == SIX || substate == SEVEN)) {
+                    transition.next = from + 1;
+                    continue;
+                }
+                if (decade >= 0 && substate == ONE && (symbol == five[decade] || symbol == ten[decade])) {
+                    transition.next = state(decade, DONE);
+                    transition.add = symbol_value[symbol] - 2 * symbol_value[one[decade]];
+                    continue;
+                }
+                for (int next = decade + 1; next < DECADES; next++) {
+                    if (symbol == one[next]) {
+                        transition.next = state(next, ONE);
+                        break;
+                    }
+                    if (symbol == five[next]) {
+                        transition.next = state(next, FIVE);
+                        break;
+                    }
+                }
+            }
+        }
+        accepting[ZERO] = true;
+    }
+};
+
+inline constexpr NumeralAutomaton numeral_automaton;
+
+/**
+ * @class NumeralHash
+ * Minimal perfect hash over the canonical spellings of 0..3999, built with hash-and-displace:
+ * keys are spread over buckets by one hash, then every bucket gets a seed that sends all its
+ * keys to free slots of a table with exactly one slot per key. The table is built by the compiler,
+ * so it costs nothing at startup. A token of up to 15 characters is loaded as two 64-bit words
+ * and resolved with a single probe.
+ * 
+ * Methods:
+ * NumeralHash(const char (&spellings)[COUNT][MAX_LENGTH + 1]) // builds the hash over zero-padded spellings, a spelling's value is its index.
+ * int64_t find(std::string_view token) // returns token's value, -1 if the token is not one of the spellings.
+ */
+class NumeralHash {
+public:
+    static constexpr std::size_t COUNT = 4000, MAX_LENGTH = 15;
+private:
+    struct Key {
+        uint64_t low = 0, high = 0;
+
+        constexpr bool operator==(const Key &other) const {
+            return low == other.low && high == other.high;
+        }
+    };
+
+    struct Slot {
+        Key key;
+        int64_t value = -1;
+    };
+
+    static constexpr std::size_t BUCKET_SIZE = 1, BUCKETS = COUNT / BUCKET_SIZE + 1;
+
+    uint32_t seeds_[BUCKETS] = {};
+    Slot slots_[COUNT] = {};
+
+    // Zero-pads the token to 16 bytes; no numeral contains a zero byte, so lengths stay distinct.
+    static constexpr Key pack(const char* bytes) {
+        Key key;
+        for (int i = 0; i < 8; i++) {
+            key.low |= static_cast<uint64_t>(static_cast<uint8_t>(bytes[i])) << (8 * i);
+            key.high |= static_cast<uint64_t>(static_cast<uint8_t>(bytes[i + 8])) << (8 * i);
+        }
+        return key;
+    }
+
+    // Two overlapping in-bounds loads; a token is never read past its end.
+    static Key load(std::string_view token) {
+        Key key;
+        const char* data = token.data();
+        std::size_t size = token.size();
+        if (size >= 8) {
+            uint64_t tail;
+            std::memcpy(&key.low, data, 8);
+            std::memcpy(&tail, data + size - 8, 8);
+            key.high = size == 8 ? 0 : tail >> (8 * (16 - size));
+        } else if (size >= 4) {
+            uint32_t head, tail;
+            std::memcpy(&head, data, 4);
+            std::memcpy(&tail, data + size - 4, 4);
+            key.low = head | static_cast<uint64_t>(tail) << (8 * (size - 4));
+        } else {
+            for (std::size_t i = 0; i < size; i++) {
+                key.low |= static_cast<uint64_t>(static_cast<uint8_t>(data[i])) << (8 * i);
+            }
+        }
+        return key;
+    }
+
+    static constexpr uint64_t hash(const Key &key) {
+        uint64_t h = (key.low ^ (key.high * 0x9E3779B97F4A7C15ULL)) * 0xBF58476D1CE4E5B9ULL;
+        return h ^ (h >> 31);
+    }
+
+    // Maps 32 bits of a hash to [0, size) without a division.
+    static constexpr uint32_t reduce(uint64_t h, std::size_t size) {
+        return static_cast<uint32_t>(((h & 0xFFFFFFFFULL) * size) >> 32);
+    }
+
+    static constexpr uint32_t bucket_of(uint64_t h) {
+        return reduce(h, BUCKETS);
+    }
+
+    static constexpr uint32_t slot_of(uint64_t h, uint32_t seed) {
+        return reduce(((h ^ (seed * 0x9E3779B97F4A7C15ULL)) * 0x94D049BB133111EBULL) >> 32, COUNT);
+    }
+public:
+    constexpr NumeralHash(const char (&spellings)[COUNT][MAX_LENGTH + 1]) {
+        // Keys grouped by bucket: the keys of bucket b are members[first[b]..first[b + 1]).
+        Key keys[COUNT] = {};
+        uint32_t first[BUCKETS + 1] = {}, members[COUNT] = {}, filled[BUCKETS] = {};
+        for (std::size_t i = 0; i < COUNT; i++) {
+            keys[i] = pack(spellings[i]);
+            first[bucket_of(hash(keys[i])) + 1]++;
+        }
+        uint32_t largest = 0;
+        for (std::size_t bucket = 0; bucket < BUCKETS; bucket++) {
+            largest = std::max(largest, first[bucket + 1]);
+            first[bucket + 1] += first[bucket];
+        }
+        for (uint32_t i = 0; i < COUNT; i++) {
+            uint32_t bucket = bucket_of(hash(keys[i]));
+            members[first[bucket] + filled[bucket]++] = i;
+        }
+
+        // Largest buckets first, while most slots are free.
+        bool taken[COUNT] = {};
+        uint32_t placed[COUNT] = {};
+        for (uint32_t size = largest; size > 0; size--) {
+            for (uint32_t bucket = 0; bucket < BUCKETS; bucket++) {
+                if (first[bucket + 1] - first[bucket] != size) {
+                    continue;
+                }
+                for (uint32_t seed = 1; !seeds_[bucket]; seed++) {
+                    uint32_t count = 0;
+                    for (; count < size; count++) {
+                        uint32_t slot = slot_of(hash(keys[members[first[bucket] + count]]), seed);
+                        bool repeated = taken[slot];
+                        for (uint32_t j = 0; j < count && !repeated; j++) {
+                            repeated = placed[j] == slot;
+                        }
+                        if (repeated) {
+                            break;
+                        }
+                        placed[count] = slot;
+                    }
+                    if (count == size) {
+                        seeds_[bucket] = seed;
+                        for (uint32_t j = 0; j < size; j++) {
+                            taken[placed[j]] = true;
+                            slots_[placed[j]] = {keys[members[first[bucket] + j]], members[first[bucket] + j]};
+                        }
+                    }
+                }
+            }
+        }
+    }
 
-        return h1 ^ h2;  
+    int64_t find(std::string_view token) const {
+        Key key = load(token);
+        uint64_t h = hash(key);
+        const Slot &slot = slots_[slot_of(h, seeds_[bucket_of(h)])];
+        return slot.key == key ? slot.value : -1;
     }
 };
 
 /**
  * @class RomanConverter
  * The class is used to convert numbers to and from the Roman numeral system.
+ * All the conversion tables are static constexpr data, so a converter costs nothing to construct.
+ * Canonical numerals are decoded with a single NumeralHash probe, the rest character by character.
  * 
  * Methods:
- * int64_t to_int64(const std::string &value) // converts to integer value from Roman value represented as string.
+ * int64_t to_int64(std::string_view value) // converts to integer value from Roman value represented as string, ignoring whitespace.
  * std::string to_roman(int64_t value) // converts to Roman numver from integer value. 
+ * int64_t to_int64_strict(std::string_view value) // same, but returns -1 for a non-canonical numeral.
+ * int64_t canonical_value(std::string_view value) // value of a canonical spelling as to_roman() writes it, -1 for anything else.
+ * void to_roman(int64_t value, std::string &result) // same, but reuses result's capacity.
+ * void decode(Decoder &decoder, char literal) // feeds the next non-whitespace character of a numeral to decoder.
+ * int64_t decoded(const Decoder &decoder, bool strict) // value of the numeral fed to decoder, as to_int64() or to_int64_strict() gives it.
  */
 class RomanConverter {
 private:
-    const int BOUND = 3999;
-    std::unordered_map<char, int64_t> rule_add = {
-        {'I', 1},
-        {'V', 5},
-        {'X', 10},
-        {'L', 50},
-        {'C', 100},
-        {'D', 500},
-        {'M', 1000}
+    struct Subtraction {
+        char left, right;
+        int64_t value;
+    };
+
+    struct Weight {
+        int value;
+        const char* symbol;
+    };
+
+    static constexpr int BOUND = 3999;
+
+    static constexpr Subtraction rule_div[] = {
+        {'I', 'V', 3},
+        {'I', 'X', 8},
+        {'X', 'L', 30},
+        {'X', 'C', 80},
+        {'C', 'D', 300},
+        {'C', 'M', 800}
+    };
+
+    static constexpr Weight weight[] = {
+        {1000, "M"},
+        {900, "CM"},
+        {500, "D"},
+        {400, "CD"},
+        {100, "C"},
+        {90, "XC"},
+        {50, "L"},
+        {40,"XL"},
+        {10, "X"},
+        {9, "IX"},
+        {5, "V"},
+        {4, "IV"},
+        {1, "I"},
+        {0, "Z"},
     };
 
-    std::unordered_map<std::pair<char, char>, int64_t, pair_hash> rule_div = {
-        {{'I', 'V'}, 3},
-        {{'I', 'X'}, 8},
-        {{'X', 'L'}, 30},
-        {{'X', 'C'}, 80},
-        {{'C', 'D'}, 300},
-        {{'C', 'M'}, 800}
+    static constexpr int64_t rule_add(char literal) {
+        return char_table[literal].value;
+    }
+
+    static const NumeralHash numeral_hash;
+
+    // Canonical spellings of 0..BOUND as to_roman() writes them, zero-padded.
+    struct Spellings {
+        char text[BOUND + 1][NumeralHash::MAX_LENGTH + 1] = {};
     };
 
-    std::vector<std::pair<int, std::string> > weight = {
-        {1000, "M"},
-        {900, "CM"},
-        {500, "D"},
-        {400, "CD"},
-        {100, "C"},
-        {90, "XC"},
-        {50, "L"},
-        {40,"XL"},
-        {10, "X"},
-        {9, "IX"},
-        {5, "V"},
-        {4, "IV"},
-        {1, "I"},
-        {0, "Z"},
-    };
+    static constexpr Spellings canonical_numerals() {
+        Spellings numerals;
+        numerals.text[0][0] = 'Z';
+        for (int value = 1; value <= BOUND; value++) {
+            int rest = value, length = 0;
+            while (rest > 0) {
+                for (const Weight &w : weight) {
+                    if (rest >= w.value) {
+                        rest -= w.value;
+                        for (const char* symbol = w.symbol; *symbol; symbol++) {
+                            numerals.text[value][length++] = *symbol;
+                        }
+                        break;
+                    }
+                }
+            }
+        }
+        return numerals;
+    }
+
+    static constexpr int64_t subtract(char left, char right) {
+        for (const Subtraction &rule : rule_div) {
+            if (rule.left == left && rule.right == right) {
+                return rule.value;
+            }
+        }
+        return 0;
+    }
+public:
+    int64_t canonical_value(std::string_view value) const {
+        return value.size() <= NumeralHash::MAX_LENGTH ? numeral_hash.find(value) : -1;
+    }
+
+    int64_t to_int64(std::string_view value) const {
+        if (value.size() <= NumeralHash::MAX_LENGTH) {
+            int64_t known = numeral_hash.find(value);
+            if (known >= 0) {
+                return known;
+            }
+        }
+        if (value.size() == 1 && value[0] == 'Z') {
+            return 0;
+        }
+        int64_t result = 0;
+        char prev_literal = 0;
+
+        for (char literal : value) {
+            if (is_space(literal)) {
+                continue;
+            }
+            if (prev_literal && rule_add(prev_literal) < rule_add(literal)) {
+                result += subtract(prev_literal, literal);
+            } else {
+                result += rule_add(literal);
+            }
+            prev_literal = literal;
+        }
+
+        return result;
+    }
+
+    int64_t to_int64_strict(std::string_view value) const {
+        if (value.size() <= NumeralHash::MAX_LENGTH) {
+            int64_t known = numeral_hash.find(value);
+            if (known >= 0) {
+                return known;
+            }
+        }
+        int state = NumeralAutomaton::START;
+        int64_t result = 0;
+
+        for (char literal : value) {
+            if (is_space(literal)) {
+                continue;
+            }
+            const NumeralAutomaton::Transition &transition = numeral_automaton.transitions[state][char_table[literal].symbol];
+            state = transition.next;
+            result += transition.add;
+        }
+
+        return numeral_automaton.accepting[state] ? result : -1;
+    }
+
+    // State of a numeral decoded a character at a time, both the lenient and the strict way.
+    struct Decoder {
+        int64_t lenient = 0, strict = 0;
+        char previous = 0;
+        int state = NumeralAutomaton::START;
+    };
+
+    void decode(Decoder &decoder, char literal) const {
+        if (decoder.previous && rule_add(decoder.previous) < rule_add(literal)) {
+            decoder.lenient += subtract(decoder.previous, literal);
+        } else {
+            decoder.lenient += rule_add(literal);
+        }
+        decoder.previous = literal;
+        const NumeralAutomaton::Transition &transition = numeral_automaton.transitions[decoder.state][char_table[literal].symbol];
+        decoder.state = transition.next;
+        decoder.strict += transition.add;
+    }
+
+    int64_t decoded(const Decoder &decoder, bool strict) const {
+        if (!strict) {
+            return decoder.lenient;
+        }
+        return numeral_automaton.accepting[decoder.state] ? decoder.strict : -1;
+    }
+
+    std::string to_roman(int64_t value) const {
+        std::string result;
+        to_roman(value, result);
+        return result;
+    }
+
+    void to_roman(int64_t value, std::string &result) const {
+        StageTimer timer(Stage::TO_ROMAN);
+        if (std::abs(value) > BOUND) {
+            throw CalcError(ErrorCode::ROMAN_OVERFLOW, "Roman number overflow");
+        }
+        result.clear();
+        if (!value) {
+            result += 'Z';
+            return;
+        }
+
+        if (value < 0) {
+            result += '-';
+            value = abs(value);
+        }
+
+        while (value > 0) {
+            for (const Weight &w : weight) {
+                if (value >= w.value) {
+                    value -= w.value;
+                    result += w.symbol;
+                    break;
+                }
+            }
+        }
+    }
+};
+
+constexpr NumeralHash RomanConverter::numeral_hash(RomanConverter::canonical_numerals().text);
+
+/**
+ * @class ElementType
+ * The class lists all the possible elements of our expressions.
+ */
+enum class ElementType {
+    BRACKET,
+    BINARY_OPERATION,
+    VALUE
+};
+
+/**
+ * The one step every evaluator of the Reverse Polish notation shares. apply(left, right) combines
+ * two values: sums, differences and products wrap around, a division truncates both values to int
+ * and rounds the quotient down in wrapping int arithmetic, a divisor truncating to zero leaves left
+ * as it is. No input traps.
+ * apply(symbol, stack) replaces the top two values of a stack by their combination; with less than
+ * two values it leaves the stack as it is, on a zero divisor it pops the divisor. solve_error()
+ * makes the CalcError of the ErrorCode they return.
+ */
+template <char Symbol>
+inline ErrorCode apply(int64_t &left, int64_t right) {
+    if constexpr (Symbol == '+') {
+        left = static_cast<int64_t>(static_cast<uint64_t>(left) + static_cast<uint64_t>(right));
+    } else if constexpr (Symbol == '-') {
+        left = static_cast<int64_t>(static_cast<uint64_t>(left) - static_cast<uint64_t>(right));
+    } else if constexpr (Symbol == '*') {
+        left = static_cast<int64_t>(static_cast<uint64_t>(left) * static_cast<uint64_t>(right));
+    } else {
+        static_assert(Symbol == '/', "not a binary operator");
+        // The quotient is an int, and abs() and the rounding sum wrap around in 32 bits as they
+        // always did. INT_MIN / -1, the one int division that traps, wraps to INT_MIN.
+        int dividend = static_cast<int>(left), divisor = static_cast<int>(right);
+        if (divisor == 0) {
+            return ErrorCode::DIVISION_BY_ZERO;
+        }
+        auto magnitude = [](int value) {
+            return value < 0 ? 0u - static_cast<uint32_t>(value) : static_cast<uint32_t>(value);
+        };
+        if ((dividend <= 0 && divisor < 0) || (dividend >= 0 && divisor > 0)) {
+            left = divisor == -1 ? static_cast<int>(0u - static_cast<uint32_t>(dividend)) : dividend / divisor;
+        } else {
+            uint32_t scale = magnitude(divisor);
+            left = static_cast<int>(0u - (magnitude(dividend) + scale - 1)) / static_cast<int>(scale);
+        }
+    }
+    return ErrorCode::NONE;
+}
+
+inline ErrorCode apply(char symbol, int64_t &left, int64_t right) {
+    switch (symbol) {
+        case '+':
+            return apply<'+'>(left, right);
+        case '-':
+            return apply<'-'>(left, right);
+        case '*':
+            return apply<'*'>(left, right);
+        default:
+            return apply<'/'>(left, right);
+    }
+}
+
+inline ErrorCode apply(char symbol, std::vector<int64_t> &stack) {
+    if (stack.size() < 2) {
+        return ErrorCode::INVALID_FORMAT;
+    }
+    int64_t right = stack.back();
+    stack.pop_back();
+    return apply(symbol, stack.back(), right);
+}
+
+inline CalcError solve_error(ErrorCode code) {
+    if (code == ErrorCode::DIVISION_BY_ZERO) {
+        return CalcError(code, "Division by zero");
+    }
+    return CalcError(ErrorCode::INVALID_FORMAT, "Invalid expression format");
+}
+
+/**
+ * @class Element
+ * Class describing the elements of an arithmetic expression
+ * 
+ * Methods:
+ * Element(int64_t value) // constructor for value-type element.
+ * Element(int value, ElementType type) // constructor for brackets and binary operators.
+ * ElementType label() // returns current element's type.
+ * int priority() // returnst current element's priority.
+ * Element proceed(const Element &left, const Element &right) // proceeds a given operation for two values. Uses only for binary operations.
+ * int64_t value() // returns current elemnt's value.
+ */
+class Element {
+public:
+    Element(int64_t value) : value_(value), label_(ElementType::VALUE), priority_(3) {}
+
+    Element(int value, ElementType type) : value_(value), label_(type) {
+        switch (value) {
+            case '+':
+            case '-':
+                priority_ = 0;
+                break;
+
+            case '*':
+            case '/':
+                priority_ = 1;
+                break;
+
+            case '(':
+            case ')':
+                priority_ = -1;
+                break;
+            
+            default:
+                break;
+        }
+    }
+
+    ElementType label() const {
+        return label_;
+    }
+
+    int priority() const {
+        return priority_;
+    }
+
+    Element proceed(const Element &left, const Element &right) const {
+        int64_t result = left.value();
+        ErrorCode error = apply(static_cast<char>(value_), result, right.value());
+        if (error != ErrorCode::NONE) {
+            throw solve_error(error);
+        }
+        return Element(result);
+    }
+
+    int64_t value() const {
+        return value_;
+    }
+
+private:
+    int64_t value_;
+    ElementType label_;
+    int priority_;
+};
+
+/**
+ * @class TokenType
+ * The class lists all the possible tokens of our expressions.
+ */
+enum class TokenType {
+    NUMBER,
+    BINARY_OPERATION,
+    UNARY_MINUS,
+    OPEN_BRACKET,
+    CLOSE_BRACKET,
+    BAD_SYMBOL,
+    BAD_NUMERAL,
+    END
+};
+
+/**
+ * @class Token
+ * A token of an expression. begin and end span the token in the original input, position is
+ * the 1-based position of its first character among the input's non-whitespace characters.
+ */
+struct Token {
+    TokenType type = TokenType::END;
+    char symbol = 0;
+    int64_t value = 0;
+    std::size_t begin = 0, end = 0;
+    int position = 0;
+};
+
+/**
+ * @class CharMasks
+ * Bitmasks classifying a block of up to 64 input bytes, bit i describes the block's i-th byte.
+ * Bytes that are in none of the masks are invalid; bits past the end of the input are clear.
+ */
+struct CharMasks {
+    uint64_t space = 0, numeral = 0, operation = 0, open = 0, close = 0;
+};
+
+inline CharMasks classify_scalar(const char* data, std::size_t length) {
+    CharMasks masks;
+    for (std::size_t i = 0; i < length; i++) {
+        uint64_t bit = 1ULL << i;
+        switch (char_table[data[i]].type) {
+            case CharClass::SPACE: masks.space |= bit; break;
+            case CharClass::NUMERAL: masks.numeral |= bit; break;
+            case CharClass::OPERATION: masks.operation |= bit; break;
+            case CharClass::OPEN_BRACKET: masks.open |= bit; break;
+            case CharClass::CLOSE_BRACKET: masks.close |= bit; break;
+            default: break;
+        }
+    }
+    return masks;
+}
+
+#if defined(__x86_64__)
+// Both vector kernels classify a full 64-byte block with two nibble lookups: a byte's class bits
+// are low_nibble[c & 15] & high_nibble[c >> 4]. Classes spread over several high nibbles get
+// one bit per high nibble: spaces are '\t'..'\r' or ' ', numerals are "CDILM" or "VXZ".
+enum NibbleClass : uint8_t {
+    LOW_SPACE = 1, BLANK = 2, OPERATION = 4, OPEN = 8, CLOSE = 16, NUMERAL_4X = 32, NUMERAL_5X = 64
+};
+
+alignas(16) inline constexpr uint8_t low_nibble[16] = {
+    BLANK, 0, 0, NUMERAL_4X, NUMERAL_4X, 0, NUMERAL_5X, 0,
+    OPEN | NUMERAL_5X, CLOSE | LOW_SPACE | NUMERAL_4X, OPERATION | LOW_SPACE | NUMERAL_5X, OPERATION | LOW_SPACE,
+    LOW_SPACE | NUMERAL_4X, OPERATION | LOW_SPACE | NUMERAL_4X, 0, OPERATION
+};
+
+alignas(16) inline constexpr uint8_t high_nibble[16] = {
+    LOW_SPACE, 0, BLANK | OPERATION | OPEN | CLOSE, 0, NUMERAL_4X, NUMERAL_5X, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0
+};
+
+// Returns a bit for every byte of classes having any of the given class bits.
+__attribute__((target("ssse3"))) inline uint64_t mask_of(__m128i classes, uint8_t bits) {
+    __m128i none = _mm_cmpeq_epi8(_mm_and_si128(classes, _mm_set1_epi8(bits)), _mm_setzero_si128());
+    return static_cast<uint16_t>(~_mm_movemask_epi8(none));
+}
+
+__attribute__((target("avx2"))) inline uint64_t mask_of(__m256i classes, uint8_t bits) {
+    __m256i none = _mm256_cmpeq_epi8(_mm256_and_si256(classes, _mm256_set1_epi8(bits)), _mm256_setzero_si256());
+    return static_cast<uint32_t>(~_mm256_movemask_epi8(none));
+}
+
+__attribute__((target("ssse3"))) inline CharMasks classify_ssse3(const char* block) {
+    const __m128i low_table = _mm_load_si128(reinterpret_cast<const __m128i*>(low_nibble));
+    const __m128i high_table = _mm_load_si128(reinterpret_cast<const __m128i*>(high_nibble));
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    CharMasks masks;
+    for (int i = 0; i < 64; i += 16) {
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + i));
+        __m128i classes = _mm_and_si128(
+            _mm_shuffle_epi8(low_table, _mm_and_si128(c, nibble)),
+            _mm_shuffle_epi8(high_table, _mm_and_si128(_mm_srli_epi16(c, 4), nibble)));
+        masks.space |= mask_of(classes, LOW_SPACE | BLANK) << i;
+        masks.numeral |= mask_of(classes, NUMERAL_4X | NUMERAL_5X) << i;
+        masks.operation |= mask_of(classes, OPERATION) << i;
+        masks.open |= mask_of(classes, OPEN) << i;
+        masks.close |= mask_of(classes, CLOSE) << i;
+    }
+    return masks;
+}
+
+__attribute__((target("avx2"))) inline CharMasks classify_avx2(const char* block) {
+    const __m256i low_table = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(low_nibble)));
+    const __m256i high_table = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(high_nibble)));
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    CharMasks masks;
+    for (int i = 0; i < 64; i += 32) {
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + i));
+        __m256i classes = _mm256_and_si256(
+            _mm256_shuffle_epi8(low_table, _mm256_and_si256(c, nibble)),
+            _mm256_shuffle_epi8(high_table, _mm256_and_si256(_mm256_srli_epi16(c, 4), nibble)));
+        masks.space |= mask_of(classes, LOW_SPACE | BLANK) << i;
+        masks.numeral |= mask_of(classes, NUMERAL_4X | NUMERAL_5X) << i;
+        masks.operation |= mask_of(classes, OPERATION) << i;
+        masks.open |= mask_of(classes, OPEN) << i;
+        masks.close |= mask_of(classes, CLOSE) << i;
+    }
+    return masks;
+}
+#endif
+
+/**
+ * @class BlockClassifier
+ * Classifies the input 64 bytes at a time into CharMasks with the widest vector extension
+ * the CPU supports (AVX2, SSSE3 or scalar), chosen once at start-up.
+ * 
+ * Methods:
+ * static CharMasks classify(const char* data, std::size_t length) // classifies up to 64 bytes.
+ * static const char* name() // returns the name of the selected implementation.
+ */
+class BlockClassifier {
+private:
+    using Kernel = CharMasks (*)(const char* block);
+
+    static Kernel select() {
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return classify_avx2;
+        }
+        if (__builtin_cpu_supports("ssse3")) {
+            return classify_ssse3;
+        }
+#endif
+        return nullptr;
+    }
+
+    static inline const Kernel kernel_ = select();
+public:
+    static CharMasks classify(const char* data, std::size_t length) {
+        if (!kernel_) {
+            return classify_scalar(data, length);
+        }
+        if (length >= 64) {
+            return kernel_(data);
+        }
+        char block[64] = {};
+        std::memcpy(block, data, length);
+        return kernel_(block);
+    }
+
+    static const char* name() {
+#if defined(__x86_64__)
+        if (kernel_ == classify_avx2) {
+            return "avx2";
+        }
+        if (kernel_ == classify_ssse3) {
+            return "ssse3";
+        }
+#endif
+        return "scalar";
+    }
+};
+
+/**
+ * @class Fingerprint
+ * Streaming 64-bit fingerprint of the non-whitespace bytes of a text, so "X + V" and "X+V"
+ * fingerprint alike, as the lexer sees them alike. Bytes are gathered into little-endian 8-byte
+ * words and every word is folded into the state with a 64x64->128-bit multiply. update_text()
+ * finds the whitespace 64 bytes at a time with BlockClassifier masks and feeds the runs in
+ * between, whole words at a time. How the input is cut into update calls does not matter.
+ * 
+ * Methods:
+ * void update(char c) // feeds one byte.
+ * void update(std::string_view bytes) // feeds bytes as they are.
+ * void update_text(std::string_view text) // feeds the non-whitespace bytes of text.
+ * uint64_t digest() // fingerprint of everything fed so far.
+ * static uint64_t of(std::string_view text) // fingerprint of the non-whitespace bytes of text.
+ */
+class Fingerprint {
+private:
+    static constexpr uint64_t SEED = 0x243f6a8885a308d3, K1 = 0xa0761d6478bd642f, K2 = 0xe7037ed1a0b428db;
+    uint64_t state_ = SEED, word_ = 0, length_ = 0;
+
+    static uint64_t mix(uint64_t left, uint64_t right) {
+        unsigned __int128 product = static_cast<unsigned __int128>(left) * right;
+        return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+    }
+
+    void fold(uint64_t word) {
+        state_ = mix(word ^ K1, state_ ^ K2);
+    }
+public:
+    void update(char c) {
+        word_ |= static_cast<uint64_t>(static_cast<uint8_t>(c)) << (8 * (length_ & 7));
+        if ((++length_ & 7) == 0) {
+            fold(word_);
+            word_ = 0;
+        }
+    }
+
+    void update(std::string_view bytes) {
+        std::size_t i = 0;
+        while (i < bytes.size() && (length_ & 7)) {
+            update(bytes[i++]);
+        }
+        for (; i + 8 <= bytes.size(); i += 8) {
+            uint64_t word;
+            std::memcpy(&word, bytes.data() + i, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            word = __builtin_bswap64(word);
+#endif
+            fold(word);
+            length_ += 8;
+        }
+        while (i < bytes.size()) {
+            update(bytes[i++]);
+        }
+    }
+
+    void update_text(std::string_view text) {
+        for (std::size_t block = 0; block < text.size(); block += 64) {
+            std::size_t length = std::min<std::size_t>(64, text.size() - block);
+            uint64_t valid = length == 64 ? ~uint64_t(0) : (uint64_t(1) << length) - 1;
+            uint64_t keep = ~BlockClassifier::classify(text.data() + block, length).space & valid;
+            while (keep) {
+                std::size_t start = __builtin_ctzll(keep);
+                uint64_t rest = ~(keep >> start);
+                std::size_t run = rest ? __builtin_ctzll(rest) : 64 - start;
+                update(text.substr(block + start, run));
+                keep = start + run >= 64 ? 0 : keep & (~uint64_t(0) << (start + run));
+            }
+        }
+    }
+
+    uint64_t digest() const {
+        return mix(mix(word_ ^ K1, state_ ^ length_) ^ K2, SEED ^ length_);
+    }
+
+    static uint64_t of(std::string_view text) {
+        Fingerprint fingerprint;
+        fingerprint.update_text(text);
+        return fingerprint.digest();
+    }
+};
+
+// Compares the non-whitespace bytes of two texts.
+inline bool same_text(std::string_view left, std::string_view right) {
+    std::size_t i = 0, j = 0;
+    while (true) {
+        while (i < left.size() && is_space(left[i])) {
+            i++;
+        }
+        while (j < right.size() && is_space(right[j])) {
+            j++;
+        }
+        if (i == left.size() || j == right.size()) {
+            return i == left.size() && j == right.size();
+        }
+        if (left[i++] != right[j++]) {
+            return false;
+        }
+    }
+}
+
+/**
+ * @class BracketBalance
+ * Result of the bracket pre-pass: depth is the bracket depth at the end of the scanned input,
+ * min_depth and max_depth are the extremes of the running depth. valid is false if a character
+ * outside the grammar was met, then the scan stops there. The scan also stops as soon as
+ * min_depth turns negative.
+ */
+struct BracketBalance {
+    bool valid = true;
+    int depth = 0, min_depth = 0, max_depth = 0;
+
+    bool balanced() const {
+        return depth == 0 && min_depth >= 0;
+    }
+};
+
+inline BracketBalance balance_scalar(const char* data, std::size_t length, BracketBalance balance) {
+    for (std::size_t i = 0; i < length && balance.min_depth >= 0; i++) {
+        switch (char_table[data[i]].type) {
+            case CharClass::INVALID:
+                balance.valid = false;
+                return balance;
+            case CharClass::OPEN_BRACKET:
+                balance.max_depth = std::max(balance.max_depth, ++balance.depth);
+                break;
+            case CharClass::CLOSE_BRACKET:
+                balance.min_depth = std::min(balance.min_depth, --balance.depth);
+                break;
+            default:
+                break;
+        }
+    }
+    return balance;
+}
+
+#if defined(__x86_64__)
+// Scans 16 bytes at a time: brackets become +1/-1 bytes, a log-step prefix sum gives the running
+// depth inside the chunk and horizontal min/max give its extremes. Chunks without brackets only
+// pay for the validity check.
+__attribute__((target("sse4.1"))) inline BracketBalance balance_sse41(const char* data, std::size_t length) {
+    const __m128i low_table = _mm_load_si128(reinterpret_cast<const __m128i*>(low_nibble));
+    const __m128i high_table = _mm_load_si128(reinterpret_cast<const __m128i*>(high_nibble));
+    const __m128i nibble = _mm_set1_epi8(0x0F), zero = _mm_setzero_si128();
+    const __m128i open = _mm_set1_epi8('('), close = _mm_set1_epi8(')');
+    BracketBalance balance;
+    std::size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i classes = _mm_and_si128(
+            _mm_shuffle_epi8(low_table, _mm_and_si128(c, nibble)),
+            _mm_shuffle_epi8(high_table, _mm_and_si128(_mm_srli_epi16(c, 4), nibble)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(classes, zero))) {
+            balance.valid = false;
+            return balance;
+        }
+        __m128i is_open = _mm_cmpeq_epi8(c, open), is_close = _mm_cmpeq_epi8(c, close);
+        if (!_mm_movemask_epi8(_mm_or_si128(is_open, is_close))) {
+            continue;
+        }
+        __m128i depth = _mm_sub_epi8(is_close, is_open);
+        depth = _mm_add_epi8(depth, _mm_slli_si128(depth, 1));
+        depth = _mm_add_epi8(depth, _mm_slli_si128(depth, 2));
+        depth = _mm_add_epi8(depth, _mm_slli_si128(depth, 4));
+        depth = _mm_add_epi8(depth, _mm_slli_si128(depth, 8));
+        __m128i low = _mm_min_epi8(depth, _mm_srli_si128(depth, 8)), high = _mm_max_epi8(depth, _mm_srli_si128(depth, 8));
+        low = _mm_min_epi8(low, _mm_srli_si128(low, 4));
+        high = _mm_max_epi8(high, _mm_srli_si128(high, 4));
+        low = _mm_min_epi8(low, _mm_srli_si128(low, 2));
+        high = _mm_max_epi8(high, _mm_srli_si128(high, 2));
+        low = _mm_min_epi8(low, _mm_srli_si128(low, 1));
+        high = _mm_max_epi8(high, _mm_srli_si128(high, 1));
+        balance.min_depth = std::min(balance.min_depth, balance.depth + static_cast<int8_t>(_mm_extract_epi8(low, 0)));
+        balance.max_depth = std::max(balance.max_depth, balance.depth + static_cast<int8_t>(_mm_extract_epi8(high, 0)));
+        balance.depth += static_cast<int8_t>(_mm_extract_epi8(depth, 15));
+        if (balance.min_depth < 0) {
+            return balance;
+        }
+    }
+    return balance_scalar(data + i, length - i, balance);
+}
+#endif
+
+/**
+ * @class BracketScanner
+ * Pre-pass computing the BracketBalance of an input before any parsing, with SSE4.1 when the
+ * CPU supports it. Lets the solver reject unbalanced lines early and size its stack up front.
+ * 
+ * Methods:
+ * static BracketBalance scan(std::string_view data) // scans the whole input.
+ */
+class BracketScanner {
+private:
+    using Kernel = BracketBalance (*)(const char* data, std::size_t length);
+
+    static Kernel select() {
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse4.1")) {
+            return balance_sse41;
+        }
+#endif
+        return nullptr;
+    }
+
+    static inline const Kernel kernel_ = select();
+public:
+    static BracketBalance scan(std::string_view data) {
+        if (!kernel_) {
+            return balance_scalar(data.data(), data.size(), BracketBalance());
+        }
+        return kernel_(data.data(), data.size());
+    }
+};
+
+/**
+ * @class Tokenizer
+ * Splits an expression into tokens without copying it. Whitespace is skipped inline, also
+ * inside numerals, so "X V" reads as XV just as if the whitespace was stripped beforehand.
+ * Runs of whitespace and numerals are found 64 bytes at a time from BlockClassifier masks with
+ * a count of trailing zeros; single characters are classified by a char_table load. The lexer
+ * state is the class of the last consumed character, which decides together with the next one
+ * whether a minus is unary. In strict mode non-canonical numerals are returned as
+ * TokenType::BAD_NUMERAL.
+ * 
+ * Methods:
+ * Tokenizer(std::string_view data, bool strict) // starts tokenizing given string.
+ * Token next() // reads the next token, TokenType::END at the end of the input.
+ * void seek(std::size_t offset, int position, CharClass previous) // continues tokenizing from a token boundary.
+ * static bool is_unary_minus(CharClass previous, CharClass next) // tells whether a minus between such characters is unary.
+ */
+class Tokenizer {
+private:
+    // Indexed by CharClass.
+    static constexpr TokenType token_type[] = {
+        TokenType::BAD_SYMBOL, TokenType::END, TokenType::NUMBER,
+        TokenType::BINARY_OPERATION, TokenType::OPEN_BRACKET, TokenType::CLOSE_BRACKET
+    };
+    // Indexed by CharClass of the previous character, SPACE stands for the beginning of the input.
+    static constexpr bool unary_after[] = {false, true, false, true, false, true};
+    // Indexed by CharClass of the next character.
+    static constexpr bool unary_before[] = {false, false, true, false, true, false};
+
+    std::string_view data_;
+    std::size_t offset_ = 0;
+    int position_ = 0; // number of non-whitespace characters consumed.
+    CharClass previous_ = CharClass::SPACE; // class of the last consumed character.
+    bool strict_;
+    RomanConverter converter;
+    std::size_t block_ = SIZE_MAX; // offset of the block classified in masks_.
+    CharMasks masks_;
+
+    // Returns the length of the run of characters of the given mask starting at offset.
+    std::size_t run(uint64_t CharMasks::*mask, std::size_t offset) {
+        std::size_t start = offset;
+        while (offset < data_.size()) {
+            std::size_t block = offset & ~static_cast<std::size_t>(63);
+            if (block != block_) {
+                masks_ = BlockClassifier::classify(data_.data() + block, std::min<std::size_t>(64, data_.size() - block));
+                block_ = block;
+            }
+            std::size_t shift = offset - block;
+            uint64_t outside = ~(masks_.*mask >> shift);
+            std::size_t length = outside ? __builtin_ctzll(outside) : 64;
+            if (length < 64 - shift) {
+                return offset + length - start;
+            }
+            offset = block + 64;
+        }
+        return data_.size() - start;
+    }
+
+    void skip_spaces() {
+        if (offset_ < data_.size() && is_space(data_[offset_])) {
+            offset_ += run(&CharMasks::space, offset_);
+        }
+    }
+
+    // Returns the class of the first non-whitespace character after the current one.
+    CharClass lookahead() {
+        std::size_t next = offset_ + 1;
+        if (next < data_.size() && is_space(data_[next])) {
+            next += run(&CharMasks::space, next);
+        }
+        return next < data_.size() ? char_table[data_[next]].type : CharClass::SPACE;
+    }
+
+    void consume(Token &token, CharClass type) {
+        offset_++;
+        position_++;
+        previous_ = type;
+        token.end = offset_;
+    }
+public:
+    Tokenizer(std::string_view data, bool strict = false) : data_(data), strict_(strict) {}
+
+    // Continues from offset as if position non-whitespace characters of class previous came before.
+    void seek(std::size_t offset, int position, CharClass previous) {
+        offset_ = offset;
+        position_ = position;
+        previous_ = previous;
+    }
+
+    static bool is_unary_minus(CharClass previous, CharClass next) {
+        return unary_after[static_cast<int>(previous)] && unary_before[static_cast<int>(next)];
+    }
+
+    Token next() {
+        skip_spaces();
+        Token token;
+        token.begin = token.end = offset_;
+        token.position = position_ + 1;
+        if (offset_ == data_.size()) {
+            return token;
+        }
+
+        char c = data_[offset_];
+        CharClass type = char_table[c].type;
+        token.symbol = c;
+        token.type = token_type[static_cast<int>(type)];
+        switch (type) {
+            case CharClass::NUMERAL:
+                while (offset_ < data_.size() && char_table[data_[offset_]].type == CharClass::NUMERAL) {
+                    std::size_t length = run(&CharMasks::numeral, offset_);
+                    offset_ += length;
+                    position_ += length;
+                    previous_ = type;
+                    token.end = offset_;
+                    skip_spaces();
+                }
+                if (strict_) {
+                    token.value = converter.to_int64_strict(data_.substr(token.begin, token.end - token.begin));
+                    if (token.value < 0) {
+                        token.type = TokenType::BAD_NUMERAL;
+                    }
+                } else {
+                    token.value = converter.to_int64(data_.substr(token.begin, token.end - token.begin));
+                }
+                return token;
+
+            case CharClass::INVALID:
+                return token;
+
+            case CharClass::OPERATION:
+                if (c == '-' && is_unary_minus(previous_, lookahead())) {
+                    token.type = TokenType::UNARY_MINUS;
+                }
+                break;
+
+            default:
+                break;
+        }
+        consume(token, type);
+        return token;
+    }
+};
+
+/**
+ * Number of threads the hardware runs at once. Queried once, the query reads sysfs.
+ */
+inline unsigned hardware_threads() {
+    static const unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    return threads;
+}
+
+/**
+ * @class TaskGroup
+ * Set of tasks a thread can wait for, see TaskPool. Keeps the first exception thrown by its tasks.
+ * pending is only lowered under mutex, and done is notified when it reaches 0.
+ */
+struct TaskGroup {
+    std::atomic<std::size_t> pending{0};
+    std::mutex mutex;
+    std::condition_variable done;
+    std::exception_ptr error;
+};
+
+/**
+ * @class TaskPool
+ * Work-stealing pool of threads. Every worker owns a deque of tasks: it pushes and pops its own
+ * work at the back and, once it runs dry, steals from the front of the other deques, where the
+ * oldest and usually largest pieces of work are. Threads outside the pool share deque 0. A
+ * thread waiting for a TaskGroup runs the group's tasks still in its own deque meanwhile, so tasks
+ * may fork and wait themselves, and sleeps once none is left until the group is done. It never
+ * runs an unrelated task, which could reenter the thread_local state of the task it waits in.
+ * Idle workers sleep until something is queued. The shared pool is only started by its first use, so runs that never
+ * need it have no extra threads.
+ * 
+ * Methods:
+ * static void configure(unsigned threads) // sizes the shared pool before its first use; 0 stands for all cores.
+ * static TaskPool& shared() // the process-wide pool, started on the first call.
+ * static bool started() // tells whether the shared pool has been started.
+ * unsigned size() // number of threads running tasks, a waiting caller included.
+ * void submit(TaskGroup &group, std::function<void()> task) // queues a task of the group.
+ * void wait(TaskGroup &group) // runs tasks of the group until it is done, rethrows its first exception.
+ * void dump(std::ostream &out) // prints how many tasks every deque's owner ran and stole.
+ */
+class TaskPool {
+private:
+    struct Task {
+        std::function<void()> function;
+        TaskGroup* group;
+    };
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+        std::atomic<uint64_t> executed{0}, stolen{0};
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::thread> threads_;
+    std::atomic<std::size_t> queued_{0};
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    bool stop_ = false;
+    static inline thread_local unsigned current_ = 0; // deque of the running thread.
+    static inline unsigned configured_ = 0; // size of the shared pool.
+    static inline std::atomic<bool> started_{false};
+
+    bool take(Task &task) {
+        for (unsigned i = 0; i < workers_.size(); i++) {
+            Worker &worker = *workers_[(current_ + i) % workers_.size()];
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            if (worker.tasks.empty()) {
+                continue;
+            }
+            if (i == 0) {
+                task = std::move(worker.tasks.back());
+                worker.tasks.pop_back();
+            } else {
+                task = std::move(worker.tasks.front());
+                worker.tasks.pop_front();
+                workers_[current_]->stolen.fetch_add(1, std::memory_order_relaxed);
+            }
+            queued_--;
+            return true;
+        }
+        return false;
+    }
+
+    // Takes the last task of the caller's deque if it belongs to group. The waiter queued the
+    // group's tasks there itself, and whatever it queued later belongs to groups it already waited
+    // for, so the rest of them are at the back unless they have been stolen.
+    bool take(Task &task, const TaskGroup &group) {
+        Worker &worker = *workers_[current_];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (worker.tasks.empty() || worker.tasks.back().group != &group) {
+            return false;
+        }
+        task = std::move(worker.tasks.back());
+        worker.tasks.pop_back();
+        queued_--;
+        return true;
+    }
+
+    void execute(Task &task) {
+        try {
+            task.function();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(task.group->mutex);
+            if (!task.group->error) {
+                task.group->error = std::current_exception();
+            }
+        }
+        workers_[current_]->executed.fetch_add(1, std::memory_order_relaxed);
+        // The waiter may destroy the group as soon as it sees pending at 0 under the mutex.
+        std::lock_guard<std::mutex> lock(task.group->mutex);
+        if (--task.group->pending == 0) {
+            task.group->done.notify_all();
+        }
+    }
+
+    void work(unsigned index) {
+        current_ = index;
+        Task task;
+        while (true) {
+            if (take(task)) {
+                execute(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_mutex_);
+            wake_.wait(lock, [this] {
+                return stop_ || queued_ > 0;
+            });
+            if (stop_) {
+                return;
+            }
+        }
+    }
+public:
+    TaskPool(unsigned threads) {
+        threads = std::max(1u, threads);
+        for (unsigned i = 0; i < threads; i++) {
+            workers_.push_back(std::make_unique<Worker>());
+        }
+        for (unsigned i = 1; i < threads; i++) {
+            threads_.emplace_back(&TaskPool::work, this, i);
+        }
+    }
+
+    ~TaskPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (std::thread &thread : threads_) {
+            thread.join();
+        }
+    }
+
+    static void configure(unsigned threads) {
+        configured_ = threads;
+    }
+
+    static TaskPool& shared() {
+        static TaskPool pool(configured_ ? configured_ : hardware_threads());
+        started_ = true;
+        return pool;
+    }
+
+    static bool started() {
+        return started_;
+    }
+
+    unsigned size() const {
+        return workers_.size();
+    }
+
+    void submit(TaskGroup &group, std::function<void()> task) {
+        group.pending++;
+        {
+            Worker &worker = *workers_[current_];
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.tasks.push_back(Task{std::move(task), &group});
+        }
+        queued_++;
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+        }
+        wake_.notify_one();
+    }
+
+    void wait(TaskGroup &group) {
+        Task task;
+        while (group.pending > 0 && take(task, group)) {
+            execute(task);
+        }
+        {
+            std::unique_lock<std::mutex> lock(group.mutex);
+            group.done.wait(lock, [&group] {
+                return group.pending == 0;
+            });
+        }
+        if (group.error) {
+            std::rethrow_exception(group.error);
+        }
+    }
+
+    void dump(std::ostream &out) {
+        out << "worker     tasks   stolen\n";
+        for (unsigned i = 0; i < workers_.size(); i++) {
+            out << std::setw(6) << i << ' '
+                << std::setw(9) << workers_[i]->executed.load() << ' '
+                << std::setw(8) << workers_[i]->stolen.load() << '\n';
+        }
+        out.flush();
+    }
+};
+
+/**
+ * Runs function(0), ..., function(count - 1) as tasks of the shared TaskPool, index 0 on the
+ * calling thread, and returns once all of them are done.
+ */
+template <class Function>
+void run_parallel(unsigned count, Function function) {
+    TaskPool &pool = TaskPool::shared();
+    TaskGroup group;
+    for (unsigned i = 1; i < count; i++) {
+        pool.submit(group, [&function, i] {
+            function(i);
+        });
+    }
+    function(0);
+    pool.wait(group);
+}
+
+/**
+ * @class ChainScanner
+ * Finds the loosest binary operators outside of all brackets, which make the expression a
+ * left-to-right chain of operands: the '+' and '-' ones if there are any, the '*' and '/' ones
+ * otherwise. The input is cut into 64-byte aligned parts scanned on several threads. The first
+ * pass counts the bracket balance of every part, the second one starts every part at the depth
+ * given by the prefix sum of these counts. Expects valid characters and balanced brackets.
+ * 
+ * Methods:
+ * static std::vector<std::size_t> split(std::string_view data, unsigned threads) // offsets of the chain's operators.
+ */
+class ChainScanner {
+private:
+    struct Part {
+        int depth = 0; // bracket depth at the start of the part.
+        std::vector<std::size_t> low, high; // offsets of '+' and '-', of '*' and '/' at depth 0.
+    };
+
+    static int balance(std::string_view data, std::size_t begin, std::size_t end) {
+        int depth = 0;
+        for (std::size_t block = begin; block < end; block += 64) {
+            CharMasks masks = BlockClassifier::classify(data.data() + block, std::min<std::size_t>(64, end - block));
+            depth += __builtin_popcountll(masks.open) - __builtin_popcountll(masks.close);
+        }
+        return depth;
+    }
+
+    static bool is_binary(std::string_view data, std::size_t offset) {
+        if (data[offset] != '-') {
+            return true;
+        }
+        std::size_t previous = offset, next = offset + 1;
+        while (previous > 0 && is_space(data[previous - 1])) {
+            previous--;
+        }
+        while (next < data.size() && is_space(data[next])) {
+            next++;
+        }
+        return !Tokenizer::is_unary_minus(previous > 0 ? char_table[data[previous - 1]].type : CharClass::SPACE,
+                                          next < data.size() ? char_table[data[next]].type : CharClass::SPACE);
+    }
+
+    static void scan(std::string_view data, std::size_t begin, std::size_t end, Part &part) {
+        int depth = part.depth;
+        for (std::size_t block = begin; block < end; block += 64) {
+            CharMasks masks = BlockClassifier::classify(data.data() + block, std::min<std::size_t>(64, end - block));
+            uint64_t brackets = masks.open | masks.close;
+            if (depth > 0 && !brackets) {
+                continue;
+            }
+            for (uint64_t bits = brackets | masks.operation; bits; bits &= bits - 1) {
+                int index = __builtin_ctzll(bits);
+                uint64_t bit = uint64_t(1) << index;
+                std::size_t offset = block + index;
+                if (masks.open & bit) {
+                    depth++;
+                } else if (masks.close & bit) {
+                    depth--;
+                } else if (depth > 0) {
+                    continue;
+                } else if (data[offset] == '+' || data[offset] == '-') {
+                    if (is_binary(data, offset)) {
+                        part.low.push_back(offset);
+                    }
+                } else if (part.low.empty()) {
+                    part.high.push_back(offset);
+                }
+            }
+        }
+    }
+public:
+    static std::vector<std::size_t> split(std::string_view data, unsigned threads) {
+        std::size_t blocks = (data.size() + 63) / 64;
+        threads = std::max<std::size_t>(1, std::min<std::size_t>(threads, blocks));
+        auto bound = [&](unsigned part) {
+            return std::min(data.size(), blocks * part / threads * 64);
+        };
+
+        std::vector<Part> parts(threads + 1);
+        run_parallel(threads, [&](unsigned part) {
+            parts[part + 1].depth = balance(data, bound(part), bound(part + 1));
+        });
+        for (unsigned part = 1; part < threads; part++) {
+            parts[part].depth += parts[part - 1].depth;
+        }
+        run_parallel(threads, [&](unsigned part) {
+            scan(data, bound(part), bound(part + 1), parts[part]);
+        });
+
+        bool low = std::any_of(parts.begin(), parts.end(), [](const Part &part) {
+            return !part.low.empty();
+        });
+        std::vector<std::size_t> operators;
+        for (const Part &part : parts) {
+            const std::vector<std::size_t> &offsets = low ? part.low : part.high;
+            operators.insert(operators.end(), offsets.begin(), offsets.end());
+        }
+        return operators;
+    }
+};
+
+// One symbol of a kernel's program: pushes a literal or applies an operator to the top two values.
+template <char Symbol>
+inline void kernel_step(int64_t* stack, int &depth, const Element &element) {
+    if constexpr (Symbol == 'n') {
+        stack[depth++] = element.value();
+    } else {
+        depth--;
+        ErrorCode error = apply<Symbol>(stack[depth - 1], stack[depth]);
+        if (error != ErrorCode::NONE) {
+            throw solve_error(error);
+        }
+    }
+}
+
+// Evaluates the Reverse Polish notation of the given program, unrolled at compile time.
+template <char... Program>
+int64_t shape_kernel(const Element* rpn) {
+    int64_t stack[sizeof...(Program)];
+    int depth = 0;
+    (kernel_step<Program>(stack, depth, *rpn++), ...);
+    return stack[0];
+}
+
+/**
+ * @class ShapeKernels
+ * Straight-line evaluators for the most common shapes, generated at compile time. A kernel is
+ * shape_kernel<Program...>: the program's symbols unroll into a fixed sequence of pushes and
+ * apply<Symbol> steps on a local array, so the stack depth and every operator are constants
+ * and the generic loop of ExpressionSolver::compute() with its checks goes away. Kernels exist
+ * for a op b, a op b op c, a op (b op c), (a op b) op (c op d) and a op b op c op d with any
+ * of the four operators, found by the pattern of the program and the operators' indices.
+ * 
+ * Methods:
+ * static Function find(const std::string &program) // returns the program's kernel, nullptr if there is none.
+ */
+class ShapeKernels {
+public:
+    using Function = int64_t (*)(const Element* rpn);
+private:
+    // Operator of the given slot of a kernel, two bits of the index per slot.
+    template <int Index, int Slot>
+    static constexpr char op = "+-*/"[(Index >> (2 * Slot)) & 3];
+
+    template <int I>
+    struct Binary {
+        static constexpr const char* pattern = "nn?";
+        static constexpr Function run = shape_kernel<'n', 'n', op<I, 0>>;
+    };
+
+    template <int I>
+    struct LeftTriple {
+        static constexpr const char* pattern = "nn?n?";
+        static constexpr Function run = shape_kernel<'n', 'n', op<I, 0>, 'n', op<I, 1>>;
+    };
+
+    template <int I>
+    struct RightTriple {
+        static constexpr const char* pattern = "nnn??";
+        static constexpr Function run = shape_kernel<'n', 'n', 'n', op<I, 0>, op<I, 1>>;
+    };
+
+    template <int I>
+    struct Pairs {
+        static constexpr const char* pattern = "nn?nn??";
+        static constexpr Function run = shape_kernel<'n', 'n', op<I, 0>, 'n', 'n', op<I, 1>, op<I, 2>>;
+    };
+
+    template <int I>
+    struct LeftQuadruple {
+        static constexpr const char* pattern = "nn?n?n?";
+        static constexpr Function run = shape_kernel<'n', 'n', op<I, 0>, 'n', op<I, 1>, 'n', op<I, 2>>;
+    };
+
+    template <template <int> class Shape, int... I>
+    static Function match(const std::string &pattern, int index, std::integer_sequence<int, I...>) {
+        static constexpr Function kernels[] = {Shape<I>::run...};
+        return pattern == Shape<0>::pattern ? kernels[index] : nullptr;
+    }
+public:
+    static Function find(const std::string &program) {
+        std::string pattern = program;
+        int index = 0, slot = 0;
+        for (char &symbol : pattern) {
+            if (symbol != 'n') {
+                if (slot == 3) {
+                    return nullptr; // no kernel has more than three operators.
+                }
+                index |= static_cast<int>(std::strchr("+-*/", symbol) - "+-*/") << (2 * slot++);
+                symbol = '?';
+            }
+        }
+        Function kernel = nullptr;
+        if (slot == 1) {
+            kernel = match<Binary>(pattern, index, std::make_integer_sequence<int, 4>());
+        } else if (slot == 2) {
+            kernel = match<LeftTriple>(pattern, index, std::make_integer_sequence<int, 16>());
+            kernel = kernel ? kernel : match<RightTriple>(pattern, index, std::make_integer_sequence<int, 16>());
+        } else if (slot == 3) {
+            kernel = match<Pairs>(pattern, index, std::make_integer_sequence<int, 64>());
+            kernel = kernel ? kernel : match<LeftQuadruple>(pattern, index, std::make_integer_sequence<int, 64>());
+        }
+        return kernel;
+    }
+};
+
+/**
+ * @class ShapeCache
+ * Compiled shapes of expressions. The shape of an expression is its token sequence with every
+ * literal replaced by 'n', so "X+V" and "III+II" share the shape "n+n"; unary minuses are folded
+ * into the literals. A shape compiles to its Reverse Polish notation with an 'n' slot for every
+ * literal. The shunting-yard keeps the literals in order, so an expression binds to its program
+ * by filling the slots left to right. Shapes are looked up by a 64-bit Fingerprint of the token
+ * sequence and checked against the sequence itself. Every shape gets an id in insertion order
+ * and the ShapeKernels kernel of its program, if there is one.
+ * 
+ * Methods:
+ * const Shape* find(uint64_t fingerprint, const std::string &tokens) // returns the shape, nullptr if unknown.
+ * const Shape* insert(uint64_t fingerprint, const std::string &tokens, const std::string &program) // adds a shape, nullptr if it does not fit.
+ * std::size_t size() // number of cached shapes.
+ */
+class ShapeCache {
+public:
+    static constexpr std::size_t CAPACITY = 4096;
+    static constexpr std::size_t MAX_TOKENS = 256;
+
+    struct Shape {
+        std::string tokens, program;
+        uint32_t id;
+        ShapeKernels::Function kernel;
+    };
+
+    const Shape* find(uint64_t fingerprint, const std::string &tokens) const {
+        auto it = shapes_.find(fingerprint);
+        return it != shapes_.end() && it->second.tokens == tokens ? &it->second : nullptr;
+    }
+
+    const Shape* insert(uint64_t fingerprint, const std::string &tokens, const std::string &program) {
+        if (tokens.empty() || tokens.size() > MAX_TOKENS || shapes_.size() >= CAPACITY) {
+            return nullptr;
+        }
+        auto inserted = shapes_.emplace(fingerprint, Shape{tokens, program, static_cast<uint32_t>(shapes_.size()), ShapeKernels::find(program)});
+        return inserted.second ? &inserted.first->second : nullptr;
+    }
+
+    std::size_t size() const {
+        return shapes_.size();
+    }
+private:
+    struct Identity {
+        std::size_t operator()(uint64_t fingerprint) const {
+            return fingerprint;
+        }
+    };
+
+    std::unordered_map<uint64_t, Shape, Identity> shapes_;
+};
+
+/**
+ * @class Expression solver
+ * Parses and solves an arithmetic expression. A solver can be reused for many expressions:
+ * reset() keeps the capacity of the internal buffers, so in steady state evaluating an
+ * expression does no heap allocations. The input itself is never copied. Expressions of at
+ * least PARALLEL_THRESHOLD bytes are parsed on several threads when they are chains found by
+ * ChainScanner: every operand gets its own shunting-yard and the fragments are stitched as
+ * first operand, then every next operand followed by its operator, which is the order the
+ * sequential parser emits them in. compute() then solves the operands of such a chain on
+ * several threads too and reduces their values. Any failure falls back to the sequential code,
+ * so errors are reported exactly as before.
+ * Smaller expressions are lexed into their shape and literals first. A shape seen before in
+ * the thread is taken compiled from the ShapeCache, so only the literals are decoded and bound;
+ * a new one is compiled by the shunting-yard over its tokens. Lines with bad tokens are parsed
+ * the usual way, which reports their error, and so are lines with more than ShapeCache::MAX_TOKENS
+ * tokens, as soon as lex() gets past that many.
+ * evaluate() answers a lone literal or a literal op literal, unary minuses allowed, without the
+ * parser and the stack machine; a literal already spelled canonically is returned as it is.
+ * 
+ * Methods:
+ * ExpressionSolver(std::string_view expression) // parses given string to a Reverse Polish notation.
+ * void set_strict(bool strict) // turns rejection of non-canonical numerals on or off.
+ * void set_threads(unsigned threads) // sets the number of threads for huge expressions.
+ * void reset(std::string_view expression) // drops the current expression and parses a new one.
+ * const std::vector<Element>& rpn() // returns the Reverse Polish notation of the current expression.
+ * const ShapeCache::Shape* shape() // returns the cached shape of the current expression, nullptr if it has none.
+ * int64_t compute() // solves an expression from a current solver's state to an integer value.
+ * const std::string& solve() // solves an expression from a current solver's state.
+ * const std::string& evaluate(std::string_view expression) // resets the solver and solves the expression.
+ */
+class ExpressionSolver {
+private:
+    RomanConverter converter;
+    std::vector<Element> stack, out; // out -- Reverse Polish notation representarion array. stack -- some helpful array.
+    std::vector<int64_t> operands_; // stack of compute().
+    std::string result_; // Roman representation of the last solved expression.
+    bool strict_ = false;
+    unsigned threads_ = hardware_threads();
+    // RPN ranges of the operands when out is a chain from parse_parallel; the operator joining
+    // operand i > 0 to the ones before it follows the range, at out[chain_[i].end].
+    struct Operand {
+        std::size_t begin, end;
+    };
+    std::vector<Operand> chain_;
+
+    // The cache and the scratch buffers of lex() and compile() are shared by the solvers of a thread.
+    static inline thread_local ShapeCache shapes_;
+    static inline thread_local std::string tokens_, program_, operators_; // shape being parsed, its program and a helpful stack.
+    static inline thread_local std::vector<int64_t> literals_; // values of the literals, signed by unary minuses.
+    const ShapeCache::Shape* shape_ = nullptr; // shape of the current expression.
+    uint64_t fingerprint_ = 0; // Fingerprint of tokens_.
+
+    // Lexes the expression into its shape and literals, false if it has a bad token or more
+    // tokens than a ShapeCache shape may have.
+    bool lex(std::string_view expression) {
+        tokens_.clear();
+        literals_.clear();
+        Fingerprint fingerprint;
+        Tokenizer tokenizer(expression, strict_);
+        int unarity = 1;
+        for (Token token = tokenizer.next(); token.type != TokenType::END; token = tokenizer.next()) {
+            char symbol = token.symbol;
+            if (token.type == TokenType::NUMBER) {
+                literals_.push_back(token.value * unarity);
+                symbol = 'n';
+            } else if (token.type == TokenType::UNARY_MINUS) {
+                unarity = -1;
+                continue;
+            } else if (token.type == TokenType::BAD_SYMBOL || token.type == TokenType::BAD_NUMERAL) {
+                return false;
+            }
+            unarity = 1;
+            tokens_ += symbol;
+            if (tokens_.size() > ShapeCache::MAX_TOKENS) {
+                return false;
+            }
+            fingerprint.update(symbol);
+        }
+        fingerprint_ = fingerprint.digest();
+        return true;
+    }
+
+    // Shunting-yard over a shape, leaves its program in program_.
+    void compile(const std::string &tokens) {
+        program_.clear();
+        operators_.clear();
+        for (char symbol : tokens) {
+            if (symbol == 'n') {
+                program_ += symbol;
+            } else if (symbol == '(') {
+                operators_ += symbol;
+            } else if (symbol == ')') {
+                while (!operators_.empty() && operators_.back() != '(') {
+                    program_ += operators_.back();
+                    operators_.pop_back();
+                }
+                if (operators_.empty()) {
+                    throw CalcError(ErrorCode::INVALID_BRACKETS, "Invalid bracket sequence in expression");
+                }
+                operators_.pop_back();
+            } else {
+                int priority = Element(symbol, ElementType::BINARY_OPERATION).priority();
+                while (!operators_.empty() && Element(operators_.back(), ElementType::BINARY_OPERATION).priority() >= priority) {
+                    program_ += operators_.back();
+                    operators_.pop_back();
+                }
+                operators_ += symbol;
+            }
+        }
+        while (!operators_.empty()) {
+            if (operators_.back() == '(') {
+                throw CalcError(ErrorCode::INVALID_BRACKETS, "Invalid bracket sequence in expression");
+            }
+            program_ += operators_.back();
+            operators_.pop_back();
+        }
+    }
+
+    // Solves a lone literal or a literal op literal into result_, false for any other expression.
+    bool evaluate_simple(std::string_view expression) {
+        std::size_t i = 0, size = expression.size();
+        auto skip_spaces = [&] {
+            while (i < size && is_space(expression[i])) {
+                i++;
+            }
+        };
+        auto numeral = [&](std::size_t at) {
+            return at < size && char_table[expression[at]].type == CharClass::NUMERAL;
+        };
+
+        int64_t values[2];
+        std::string_view literal;
+        bool negative = false;
+        char operation = 0;
+        CharClass previous = CharClass::SPACE;
+        for (int operand = 0; operand < 2; operand++) {
+            skip_spaces();
+            negative = false;
+            if (i < size && expression[i] == '-') {
+                i++;
+                skip_spaces();
+                if (!numeral(i) || !Tokenizer::is_unary_minus(previous, CharClass::NUMERAL)) {
+                    return false;
+                }
+                negative = true;
+            }
+            std::size_t begin = i, end = i;
+            while (numeral(i)) {
+                while (numeral(i)) {
+                    i++;
+                }
+                end = i;
+                skip_spaces();
+            }
+            if (begin == end) {
+                return false;
+            }
+            literal = expression.substr(begin, end - begin);
+            values[operand] = strict_ ? converter.to_int64_strict(literal) : converter.to_int64(literal);
+            if (values[operand] < 0) {
+                return false;
+            }
+            values[operand] *= negative ? -1 : 1;
+            if (i == size) {
+                break;
+            }
+            if (operand == 1 || char_table[expression[i]].type != CharClass::OPERATION) {
+                return false;
+            }
+            operation = expression[i++];
+            previous = CharClass::OPERATION;
+        }
+
+        out.clear();
+        chain_.clear();
+        shape_ = nullptr;
+        out.push_back(Element(values[0]));
+        if (!operation) {
+            if (!negative && converter.canonical_value(literal) >= 0) {
+                result_.assign(literal);
+            } else {
+                converter.to_roman(values[0], result_);
+            }
+            return true;
+        }
+        Element current(operation, ElementType::BINARY_OPERATION);
+        out.push_back(Element(values[1]));
+        out.push_back(current);
+        converter.to_roman(current.proceed(out[0], out[1]).value(), result_);
+        return true;
+    }
+
+    // Fills the literal slots of a program with literals_.
+    void bind(const std::string &program) {
+        std::size_t literal = 0;
+        for (char symbol : program) {
+            out.push_back(symbol == 'n' ? Element(literals_[literal++]) : Element(symbol, ElementType::BINARY_OPERATION));
+        }
+    }
+
+    // Shunting-yard: appends the Reverse Polish notation of the expression to out.
+    void parse(std::string_view expression, std::vector<Element> &stack, std::vector<Element> &out, Probe &tokenize) const {
+        Tokenizer tokenizer(expression, strict_);
+        int unarity = 1;
+        while (true) {
+            Probe token_start = Instrumentation::sample();
+            Token token = tokenizer.next();
+            tokenize += Instrumentation::sample() - token_start;
+
+            if (token.type == TokenType::END) {
+                break;
+            } else if (token.type == TokenType::NUMBER) {
+                out.push_back(Element(token.value * unarity));
+            } else if (token.type == TokenType::OPEN_BRACKET) {
+                stack.push_back(Element('(', ElementType::BRACKET));
+            } else if (token.type == TokenType::CLOSE_BRACKET) {
+                while (!stack.empty() && stack.back().label() != ElementType::BRACKET) {
+                    out.push_back(stack.back());
+                    stack.pop_back();
+                }
+                if (stack.empty()) {
+                    throw CalcError(ErrorCode::INVALID_BRACKETS, "Invalid bracket sequence in expression");
+                }
+
+                stack.pop_back();
+            } else if (token.type == TokenType::UNARY_MINUS) {
+                unarity = -1;
+                continue;
+            } else if (token.type == TokenType::BINARY_OPERATION) {
+                Element current(token.symbol, ElementType::BINARY_OPERATION);
+                while (!stack.empty() && stack.back().priority() >= current.priority()) {
+                    out.push_back(stack.back());
+                    stack.pop_back();
+                }
+                stack.push_back(current);
+            } else if (token.type == TokenType::BAD_NUMERAL) {
+                throw CalcError(ErrorCode::NON_CANONICAL_NUMERAL, "Non-canonical numeral on position " + std::to_string(token.position), token.position);
+            } else {
+                throw CalcError(ErrorCode::BAD_SYMBOL, "Bad symbol on position " + std::to_string(token.position), token.position);
+            }
+            unarity = 1;
+        }
+
+        while (!stack.empty()) {
+            if (stack.back().label() != ElementType::BINARY_OPERATION) {
+                throw CalcError(ErrorCode::INVALID_BRACKETS, "Invalid bracket sequence in expression");
+            }
+            out.push_back(stack.back());
+            stack.pop_back();
+        }
+    }
+
+    // Parses the operands of a chain on several threads, false if it is no chain or an operand fails.
+    bool parse_parallel(std::string_view expression) {
+        std::vector<std::size_t> operators = ChainScanner::split(expression, threads_);
+        if (operators.empty()) {
+            return false;
+        }
+        std::size_t operands = operators.size() + 1;
+        unsigned threads = std::min<std::size_t>(threads_, operands);
+        std::vector<std::size_t> first(threads + 1, operands); // first operand of every thread.
+        for (unsigned thread = 0; thread < threads; thread++) {
+            std::size_t offset = expression.size() / threads * thread;
+            first[thread] = std::lower_bound(operators.begin(), operators.end(), offset) - operators.begin();
+        }
+
+        std::vector<std::vector<Element>> parts(threads);
+        std::vector<char> failed(threads, false);
+        chain_.resize(operands);
+        run_parallel(threads, [&](unsigned thread) {
+            std::vector<Element> stack;
+            Probe tokenize;
+            try {
+                for (std::size_t operand = first[thread]; operand < first[thread + 1]; operand++) {
+                    std::size_t begin = operand ? operators[operand - 1] + 1 : 0;
+                    std::size_t end = operand < operators.size() ? operators[operand] : expression.size();
+                    chain_[operand].begin = parts[thread].size();
+                    parse(expression.substr(begin, end - begin), stack, parts[thread], tokenize);
+                    chain_[operand].end = parts[thread].size();
+                    if (operand) {
+                        parts[thread].push_back(Element(expression[begin - 1], ElementType::BINARY_OPERATION));
+                    }
+                }
+            } catch (...) {
+                failed[thread] = true;
+            }
+        });
+        if (std::find(failed.begin(), failed.end(), true) != failed.end()) {
+            chain_.clear();
+            return false;
+        }
+
+        std::size_t size = 0;
+        for (const std::vector<Element> &part : parts) {
+            size += part.size();
+        }
+        out.reserve(size);
+        for (unsigned thread = 0; thread < threads; thread++) {
+            for (std::size_t operand = first[thread]; operand < first[thread + 1]; operand++) {
+                chain_[operand].begin += out.size();
+                chain_[operand].end += out.size();
+            }
+            out.insert(out.end(), parts[thread].begin(), parts[thread].end());
+        }
+        return true;
+    }
+
+    // Solves the Reverse Polish notation in out[begin, end) on top of the values.
+    void fold(std::size_t begin, std::size_t end, std::vector<int64_t> &values) const {
+        for (std::size_t i = begin; i < end; i++) {
+            const Element &element = out[i];
+            if (element.label() != ElementType::BINARY_OPERATION) {
+                values.push_back(element.value());
+                continue;
+            }
+            ErrorCode error = apply(static_cast<char>(element.value()), values);
+            if (error != ErrorCode::NONE) {
+                throw solve_error(error);
+            }
+        }
+    }
+
+    // Solves the operands of the chain on several threads, false if one of them fails or does not
+    // reduce to a single value. Sums and products are reduced per thread in wrapping uint64_t,
+    // which matches the int64_t left fold bit for bit; chains with a division are folded in order.
+    // Threads fold operands the sequential fold may never reach, so on a failure the caller drops
+    // everything and folds in order again, and the other threads stop at their next operand.
+    bool compute_parallel(int64_t &result) {
+        std::size_t operands = chain_.size();
+        unsigned threads = std::min<std::size_t>(threads_, operands);
+        bool additive = out[chain_[1].end].value() == '+' || out[chain_[1].end].value() == '-';
+        std::vector<int64_t> values(operands);
+        std::vector<uint64_t> partial(threads, additive ? 0 : 1);
+        std::vector<char> divides(threads, false);
+        std::atomic<bool> abandoned{false};
+        run_parallel(threads, [&](unsigned thread) {
+            std::vector<int64_t> stack;
+            try {
+                for (std::size_t operand = operands * thread / threads; operand < operands * (thread + 1) / threads; operand++) {
+                    if (abandoned.load(std::memory_order_relaxed)) {
+                        return;
+                    }
+                    stack.clear();
+                    fold(chain_[operand].begin, chain_[operand].end, stack);
+                    if (stack.size() != 1) {
+                        abandoned.store(true, std::memory_order_relaxed);
+                        return;
+                    }
+                    values[operand] = stack[0];
+                    int64_t operation = operand ? out[chain_[operand].end].value() : '+';
+                    uint64_t value = static_cast<uint64_t>(values[operand]);
+                    if (operation == '/') {
+                        divides[thread] = true;
+                    } else if (!additive) {
+                        partial[thread] *= value;
+                    } else if (operation == '-') {
+                        partial[thread] -= value;
+                    } else {
+                        partial[thread] += value;
+                    }
+                }
+            } catch (...) {
+                abandoned.store(true, std::memory_order_relaxed);
+            }
+        });
+        if (abandoned.load()) {
+            return false;
+        }
+
+        if (std::find(divides.begin(), divides.end(), true) != divides.end()) {
+            result = values[0];
+            for (std::size_t operand = 1; operand < operands; operand++) {
+                result = out[chain_[operand].end].proceed(Element(result), Element(values[operand])).value();
+            }
+            return true;
+        }
+        uint64_t total = additive ? 0 : 1;
+        for (uint64_t value : partial) {
+            total = additive ? total + value : total * value;
+        }
+        result = static_cast<int64_t>(total);
+        return true;
+    }
+public:
+    static constexpr std::size_t PARALLEL_THRESHOLD = 1 << 20;
+
+    ExpressionSolver() = default;
+
+    ExpressionSolver(std::string_view expression) {
+        reset(expression);
+    }
+
+    void set_strict(bool strict) {
+        strict_ = strict;
+    }
+
+    void set_threads(unsigned threads) {
+        threads_ = std::max(1u, threads);
+    }
+
+    void reset(std::string_view expression) {
+        Probe start = Instrumentation::sample(), tokenize;
+        stack.clear();
+        out.clear();
+        chain_.clear();
+        shape_ = nullptr;
+
+        // Without foreign characters the only possible parse error is a bracket one, so such lines
+        // fail before parsing. Strict mode may fail on a numeral before the brackets, so it always parses.
+        BracketBalance balance = BracketScanner::scan(expression);
+        if (balance.valid && !balance.balanced() && !strict_) {
+            throw CalcError(ErrorCode::INVALID_BRACKETS, "Invalid bracket sequence in expression");
+        }
+        if (balance.max_depth > 0) {
+            stack.reserve(2 * balance.max_depth + 2);
+        }
+
+        if (threads_ > 1 && expression.size() >= PARALLEL_THRESHOLD && balance.valid && balance.balanced() &&
+            parse_parallel(expression)) {
+            if (Instrumentation::enabled()) {
+                Instrumentation::record(Stage::SHUNTING_YARD, Instrumentation::sample() - start);
+            }
+            return;
+        }
+
+        if (expression.size() >= PARALLEL_THRESHOLD) {
+            parse(expression, stack, out, tokenize);
+        } else if (lex(expression)) {
+            tokenize = Instrumentation::sample() - start;
+            shape_ = shapes_.find(fingerprint_, tokens_);
+            if (!shape_) {
+                compile(tokens_);
+                shape_ = shapes_.insert(fingerprint_, tokens_, program_);
+            }
+            bind(shape_ ? shape_->program : program_);
+        } else {
+            parse(expression, stack, out, tokenize);
+        }
+
+        if (Instrumentation::enabled()) {
+            Instrumentation::record(Stage::TOKENIZE, tokenize);
+            Instrumentation::record(Stage::SHUNTING_YARD, Instrumentation::sample() - start - tokenize);
+        }
+    }
+    
+    const std::vector<Element>& rpn() const {
+        return out;
+    }
+
+    const ShapeCache::Shape* shape() const {
+        return shape_;
+    }
+
+    int64_t compute() {
+        StageTimer timer(Stage::SOLVE);
+        if (out.empty()) {
+            return 0;
+        }
+
+        if (shape_ && shape_->kernel) {
+            return shape_->kernel(out.data());
+        }
+        int64_t result;
+        if (chain_.size() > 1 && threads_ > 1 && compute_parallel(result)) {
+            return result;
+        }
+        operands_.clear();
+        fold(0, out.size(), operands_);
+        return operands_[0];
+    }
+
+    const std::string& solve() {
+        converter.to_roman(compute(), result_);
+        return result_;
+    }
+
+    const std::string& evaluate(std::string_view expression) {
+        if (evaluate_simple(expression)) {
+            return result_;
+        }
+        reset(expression);
+        return solve();
+    }
+};
+
+/**
+ * @class EagerParser
+ * Shunting-yard that solves every operator as soon as it leaves the operator stack, so instead of
+ * the Reverse Polish notation it keeps only the operands still waiting for an operator. Tokens
+ * are pushed one at a time and the parser is a plain value, so its state between two tokens can
+ * be copied and resumed later. Operators are solved in the order ExpressionSolver::compute()
+ * solves them; the first one failing is remembered and reported by finish(), so a parse error
+ * anywhere in the expression still takes precedence, as it does for the solver.
+ * 
+ * Methods:
+ * void push(const Token &token) // takes the next token, throws its parse error.
+ * void push_operand(int64_t value) // takes a whole bracketed span of the given value.
+ * int64_t finish() // takes the end of the expression, returns its value or throws its error.
+ * bool solved(int64_t &value) // solves the pending operators, tells whether that leaves one operand and no failure.
+ * std::size_t depth() // number of pending operators and operands.
+ * void clear() // starts a new expression, keeping the capacity.
+ */
+class EagerParser {
+private:
+    std::string operators_; // '(' and the binary operators waiting for their right operand.
+    std::vector<int64_t> values_; // operands waiting for an operator.
+    int64_t unarity_ = 1;
+    ErrorCode error_ = ErrorCode::NONE; // error of the first failed operator.
+
+    void apply(char symbol) {
+        if (error_ != ErrorCode::NONE) {
+            // Only the first error is reported, later operators just consume their operands.
+            if (values_.size() > 1) {
+                values_.pop_back();
+            }
+            return;
+        }
+        error_ = ::apply(symbol, values_);
+        if (error_ == ErrorCode::INVALID_FORMAT) {
+            values_.resize(1);
+        }
+    }
+public:
+    void push(const Token &token) {
+        switch (token.type) {
+            case TokenType::NUMBER:
+                values_.push_back(token.value * unarity_);
+                break;
+
+            case TokenType::OPEN_BRACKET:
+                operators_ += '(';
+                break;
+
+            case TokenType::CLOSE_BRACKET:
+                while (!operators_.empty() && operators_.back() != '(') {
+                    apply(operators_.back());
+                    operators_.pop_back();
+                }
+                if (operators_.empty()) {
+                    throw CalcError(ErrorCode::INVALID_BRACKETS, "Invalid bracket sequence in expression");
+                }
+                operators_.pop_back();
+                break;
+
+            case TokenType::UNARY_MINUS:
+                unarity_ = -1;
+                return;
+
+            case TokenType::BINARY_OPERATION: {
+                int priority = Element(token.symbol, ElementType::BINARY_OPERATION).priority();
+                while (!operators_.empty() && Element(operators_.back(), ElementType::BINARY_OPERATION).priority() >= priority) {
+                    apply(operators_.back());
+                    operators_.pop_back();
+                }
+                operators_ += token.symbol;
+                break;
+            }
+
+            case TokenType::BAD_NUMERAL:
+                throw CalcError(ErrorCode::NON_CANONICAL_NUMERAL, "Non-canonical numeral on position " + std::to_string(token.position), token.position);
+
+            case TokenType::BAD_SYMBOL:
+                throw CalcError(ErrorCode::BAD_SYMBOL, "Bad symbol on position " + std::to_string(token.position), token.position);
+
+            case TokenType::END:
+                break;
+        }
+        unarity_ = 1;
+    }
+
+    // Same as pushing the brackets and the tokens between them: a unary minus before them is lost.
+    void push_operand(int64_t value) {
+        values_.push_back(value);
+        unarity_ = 1;
+    }
+
+    int64_t finish() {
+        while (!operators_.empty()) {
+            if (operators_.back() == '(') {
+                throw CalcError(ErrorCode::INVALID_BRACKETS, "Invalid bracket sequence in expression");
+            }
+            apply(operators_.back());
+            operators_.pop_back();
+        }
+        if (error_ != ErrorCode::NONE) {
+            throw solve_error(error_);
+        }
+        return values_.empty() ? 0 : values_[0];
+    }
+
+    bool solved(int64_t &value) {
+        while (!operators_.empty() && operators_.back() != '(') {
+            apply(operators_.back());
+            operators_.pop_back();
+        }
+        if (!operators_.empty() || error_ != ErrorCode::NONE || values_.size() != 1) {
+            return false;
+        }
+        value = values_[0];
+        return true;
+    }
+
+    std::size_t depth() const {
+        return operators_.size() + values_.size();
+    }
+
+    void clear() {
+        operators_.clear();
+        values_.clear();
+        unarity_ = 1;
+        error_ = ErrorCode::NONE;
+    }
+};
+
+/**
+ * @class IncrementalSolver
+ * Solves an expression that is being edited, for tools re-solving it on every keystroke. It keeps
+ * the tokens of the text and copies of an EagerParser taken every CHECKPOINT_TOKENS tokens. An
+ * edit re-lexes from the token before it only until the tokens line up with the old ones again,
+ * shifting the old ones past that point, and parsing resumes from the last copy before the edit.
+ * Typing at the end of an expression thus costs the same whatever its length; an edit in the
+ * middle still replays the parser over the tokens after it, but lexes only the edited region.
+ * Copies are taken further apart while the parser is deep, so they take O(length) memory.
+ * 
+ * Methods:
+ * IncrementalSolver(bool strict) // strict rejects non-canonical numerals.
+ * void edit(std::size_t offset, std::size_t erased, std::string_view inserted) // replaces erased bytes at offset by inserted.
+ * void assign(std::string_view text) // edits the text into the given one, replacing only the span that differs.
+ * const std::string& text() // returns the current text.
+ * int64_t compute() // solves the current text to an integer value.
+ * const std::string& solve() // solves the current text to a Roman number.
+ */
+class IncrementalSolver {
+private:
+    static constexpr std::size_t CHECKPOINT_TOKENS = 64;
+
+    bool strict_;
+    RomanConverter converter;
+    std::string text_, result_;
+    std::vector<Token> tokens_, fresh_; // tokens_ ends with END or the first bad token.
+    std::vector<std::pair<std::size_t, EagerParser>> checkpoints_; // parser before the token of the index.
+    EagerParser parser_; // parser after parsed_ tokens.
+    std::size_t parsed_ = 0;
+    std::exception_ptr error_; // parse error of the last parsed token.
+
+    // Class of the last character a token consumes, the state the tokenizer continues from.
+    static CharClass class_of(const std::vector<Token> &tokens, std::size_t count) {
+        return count ? char_table[tokens[count - 1].symbol].type : CharClass::SPACE;
+    }
+
+public:
+    IncrementalSolver(bool strict = false) : strict_(strict) {
+        checkpoints_.push_back({0, EagerParser()});
+        tokens_.push_back(Token());
+    }
+
+    void edit(std::size_t offset, std::size_t erased, std::string_view inserted) {
+        std::size_t end = offset + erased; // end of the edit in the old text.
+        std::ptrdiff_t delta = static_cast<std::ptrdiff_t>(inserted.size()) - static_cast<std::ptrdiff_t>(erased);
+        text_.replace(offset, erased, inserted);
+
+        // The last token starting before the edit may grow into it, a unary minus may look into it.
+        std::size_t before = std::lower_bound(tokens_.begin(), tokens_.end(), offset, [](const Token &token, std::size_t offset) {
+            return token.begin < offset;
+        }) - tokens_.begin();
+        std::size_t first = before ? before - 1 : 0;
+        Tokenizer tokenizer(text_, strict_);
+        if (before) {
+            tokenizer.seek(tokens_[first].begin, tokens_[first].position - 1, class_of(tokens_, first));
+        }
+
+        // Old tokens starting past the edit are reused from the first one the tokenizer reaches
+        // in the same state, every token after that one comes out the same.
+        std::size_t old = std::lower_bound(tokens_.begin(), tokens_.end(), end, [](const Token &token, std::size_t end) {
+            return token.begin < end;
+        }) - tokens_.begin();
+        fresh_.clear();
+        while (true) {
+            Token token = tokenizer.next();
+            while (old < tokens_.size() && static_cast<std::ptrdiff_t>(tokens_[old].begin) + delta < static_cast<std::ptrdiff_t>(token.begin)) {
+                old++;
+            }
+            if (old < tokens_.size() && static_cast<std::ptrdiff_t>(tokens_[old].begin) + delta == static_cast<std::ptrdiff_t>(token.begin) &&
+                (fresh_.empty() ? class_of(tokens_, first) : class_of(fresh_, fresh_.size())) == class_of(tokens_, old)) {
+                int shift = token.position - tokens_[old].position;
+                for (std::size_t i = old; i < tokens_.size(); i++) {
+                    tokens_[i].begin += delta;
+                    tokens_[i].end += delta;
+                    tokens_[i].position += shift;
+                }
+                break;
+            }
+            fresh_.push_back(token);
+            if (token.type == TokenType::END || token.type == TokenType::BAD_SYMBOL || token.type == TokenType::BAD_NUMERAL) {
+                old = tokens_.size();
+                break;
+            }
+        }
+        tokens_.erase(tokens_.begin() + first, tokens_.begin() + old);
+        tokens_.insert(tokens_.begin() + first, fresh_.begin(), fresh_.end());
+
+        while (checkpoints_.back().first > first) {
+            checkpoints_.pop_back();
+        }
+        parsed_ = checkpoints_.back().first;
+        parser_ = checkpoints_.back().second;
+        error_ = nullptr;
+    }
+
+    void assign(std::string_view text) {
+        std::size_t prefix = std::mismatch(text.begin(), text.end(), text_.begin(), text_.end()).first - text.begin();
+        std::size_t suffix = 0, common = std::min(text.size(), text_.size()) - prefix;
+        while (suffix < common && text[text.size() - 1 - suffix] == text_[text_.size() - 1 - suffix]) {
+            suffix++;
+        }
+        if (prefix != text.size() || prefix != text_.size()) {
+            edit(prefix, text_.size() - prefix - suffix, text.substr(prefix, text.size() - prefix - suffix));
+        }
+    }
+
+    const std::string& text() const {
+        return text_;
+    }
+
+    int64_t compute() {
+        StageTimer timer(Stage::SOLVE);
+        for (; !error_ && parsed_ < tokens_.size(); parsed_++) {
+            if (parsed_ - checkpoints_.back().first >= std::max(CHECKPOINT_TOKENS, parser_.depth())) {
+                checkpoints_.push_back({parsed_, parser_});
+            }
+            try {
+                parser_.push(tokens_[parsed_]);
+            } catch (CalcError &e) {
+                error_ = std::current_exception();
+            }
+        }
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+        EagerParser parser = parser_;
+        return parser.finish();
+    }
+
+    const std::string& solve() {
+        converter.to_roman(compute(), result_);
+        return result_;
+    }
+};
+
+/**
+ * @class StreamingSolver
+ * Solves lines of any length in memory proportional to their bracket nesting. Input is read in
+ * CHUNK_BYTES pieces, a lexer keeping its state between pieces turns them into the tokens
+ * Tokenizer would produce, and an EagerParser solves those as they come, so neither a line nor
+ * its Reverse Polish notation is ever held. Numerals are decoded a character at a time and a
+ * minus waits for the next non-whitespace character to tell whether it is unary. After a parse
+ * error the rest of the line is skipped. It reads ahead, so it suits files and pipes rather
+ * than a terminal.
+ * 
+ * Methods:
+ * StreamingSolver(bool strict) // strict rejects non-canonical numerals.
+ * void serve(std::istream &in, std::ostream &out) // solves every line of in, printing its value or error.
+ */
+class StreamingSolver {
+private:
+    static constexpr std::size_t CHUNK_BYTES = 1 << 16;
+
+    bool strict_;
+    RomanConverter converter;
+    std::string result_;
+    std::vector<char> chunk_;
+    EagerParser parser_;
+    std::exception_ptr error_; // parse error of the current line.
+    int position_ = 0; // non-whitespace characters of the line so far.
+    CharClass previous_ = CharClass::SPACE; // class of the last non-whitespace character.
+    bool numeral_ = false, minus_ = false; // whether a numeral is being read, whether a minus waits.
+    RomanConverter::Decoder decoder_;
+    Token pending_; // numeral being read or waiting minus.
+    CharClass before_minus_ = CharClass::SPACE; // class of the character before the waiting minus.
+
+    void push(Token &token, TokenType type) {
+        token.type = type;
+        if (error_) {
+            return;
+        }
+        try {
+            parser_.push(token);
+        } catch (CalcError &e) {
+            error_ = std::current_exception();
+        }
+    }
+
+    void end_numeral() {
+        numeral_ = false;
+        pending_.value = converter.decoded(decoder_, strict_);
+        push(pending_, strict_ && pending_.value < 0 ? TokenType::BAD_NUMERAL : TokenType::NUMBER);
+    }
+
+    void end_minus(CharClass next) {
+        minus_ = false;
+        push(pending_, Tokenizer::is_unary_minus(before_minus_, next) ? TokenType::UNARY_MINUS : TokenType::BINARY_OPERATION);
+    }
+
+    void feed(char c) {
+        CharClass type = char_table[c].type;
+        if (type == CharClass::SPACE || error_) {
+            return;
+        }
+        position_++;
+        if (type == CharClass::NUMERAL) {
+            if (minus_) {
+                end_minus(type);
+            }
+            if (!numeral_) {
+                numeral_ = true;
+                decoder_ = RomanConverter::Decoder();
+                pending_.symbol = c;
+                pending_.position = position_;
+            }
+            converter.decode(decoder_, c);
+            previous_ = type;
+            return;
+        }
+
+        if (numeral_) {
+            end_numeral();
+        }
+        if (minus_) {
+            end_minus(type);
+        }
+        if (error_) {
+            return;
+        }
+        Token token;
+        token.symbol = c;
+        token.position = position_;
+        switch (type) {
+            case CharClass::OPERATION:
+                if (c == '-') {
+                    minus_ = true;
+                    before_minus_ = previous_;
+                    pending_ = token;
+                } else {
+                    push(token, TokenType::BINARY_OPERATION);
+                }
+                break;
+
+            case CharClass::OPEN_BRACKET:
+                push(token, TokenType::OPEN_BRACKET);
+                break;
+
+            case CharClass::CLOSE_BRACKET:
+                push(token, TokenType::CLOSE_BRACKET);
+                break;
+
+            default:
+                push(token, TokenType::BAD_SYMBOL);
+                break;
+        }
+        previous_ = type;
+    }
+
+    int64_t finish() {
+        if (numeral_) {
+            end_numeral();
+        }
+        if (minus_) {
+            end_minus(CharClass::SPACE);
+        }
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+        return parser_.finish();
+    }
+
+    void end_line(std::ostream &out) {
+        try {
+            converter.to_roman(finish(), result_);
+            out << result_ << '\n';
+        } catch (std::logic_error &e) {
+            out << "error: " << e.what() << '\n';
+        }
+        parser_.clear();
+        error_ = nullptr;
+        position_ = 0;
+        previous_ = CharClass::SPACE;
+        numeral_ = minus_ = false;
+    }
+public:
+    StreamingSolver(bool strict = false) : strict_(strict) {}
+
+    void serve(std::istream &in, std::ostream &out) {
+        chunk_.resize(CHUNK_BYTES);
+        bool open = false; // whether the last line has no newline yet.
+        while (in) {
+            in.read(chunk_.data(), chunk_.size());
+            const char* data = chunk_.data();
+            const char* end = data + in.gcount();
+            while (data != end) {
+                const char* newline = static_cast<const char*>(std::memchr(data, '\n', end - data));
+                const char* stop = newline ? newline : end;
+                if (error_) {
+                    data = stop;
+                }
+                for (; data != stop; data++) {
+                    feed(*data);
+                }
+                open = !newline;
+                if (newline) {
+                    end_line(out);
+                    data++;
+                    Instrumentation::dump_if_requested(std::cerr);
+                }
+            }
+            out.flush();
+        }
+        if (open) {
+            end_line(out);
+            out.flush();
+        }
+    }
+};
+
+/**
+ * @class FrameResponse
+ * Fixed-layout response of the binary protocol, 32 bytes in host byte order.
+ * 
+ * Fields:
+ * value // expression's value; also set when only the Roman conversion overflowed.
+ * position // 1-based position of the bad symbol or numeral, 0 for the other errors.
+ * error // ErrorCode of the failure, ErrorCode::NONE on success.
+ * length // number of used bytes in roman.
+ * roman // Roman representation of the value, not null-terminated.
+ */
+struct FrameResponse {
+    int64_t value;
+    uint32_t position;
+    uint8_t error;
+    uint8_t length;
+    uint16_t reserved;
+    char roman[16];
+};
+
+static_assert(sizeof(FrameResponse) == 32, "FrameResponse layout must stay fixed");
+
+/**
+ * @class BinaryServer
+ * Serves the framed protocol: every request is a uint32 length followed by that many bytes
+ * of the expression, every response is a FrameResponse. Responses are flushed once no more
+ * buffered requests are pending, so pre-framed batches are answered in one write. A frame longer
+ * than MAX_FRAME bytes is skipped unread and answered with ErrorCode::FRAME_TOO_LARGE.
+ * With batching on, frames arriving within a window after the first one are collected, up to a
+ * number of frames, and answered together. The frames are parsed one by one and grouped by the
+ * shape of their Reverse Polish notation, the sequence of operators with the literals left out.
+ * Every group is solved column by column: a literal pushes the column of its values over all the
+ * group's frames, an operator combines the two top columns in one loop. Errors stay per frame,
+ * the first one of a frame wins, as in ExpressionSolver::compute(). Frames of a shape in the
+ * ShapeCache are grouped by the shape's id, the others by their program in a map that only lives
+ * for the batch.
+ * 
+ * Methods:
+ * BinaryServer(bool strict) // creates a server, strict rejects non-canonical numerals.
+ * void set_batching(std::size_t frames, long window, int fd) // batches up to frames frames arriving within window microseconds on fd.
+ * FrameResponse evaluate(std::string_view expression) // solves a single frame's expression.
+ * void serve(std::istream &in, std::ostream &out) // answers frames until the input ends.
+ */
+class BinaryServer {
+public:
+    static constexpr uint32_t MAX_FRAME = 16 << 20;
+private:
+    RomanConverter converter;
+    ExpressionSolver solver_;
+    std::string roman_;
+    std::size_t batch_frames_ = 1;
+    std::chrono::microseconds batch_window_{0};
+    int fd_ = STDIN_FILENO;
+
+    std::vector<std::string> frames_;
+    std::vector<bool> oversized_; // frames whose payload exceeded MAX_FRAME and was skipped.
+    std::vector<FrameResponse> responses_;
+    std::vector<std::size_t> literal_begin_; // first literal of every frame in literals_.
+    std::vector<int64_t> literals_;
+    std::vector<std::vector<std::size_t>> shape_rows_; // frames by ShapeCache id, empty for shapes not in used_.
+    std::vector<const ShapeCache::Shape*> used_; // cached shapes with frames in the batch.
+    std::unordered_map<std::string, std::vector<std::size_t>> groups_; // frames of the uncached shapes, cleared every batch.
+    std::string shape_; // 'n' for a literal, the symbol for an operator.
+    std::vector<std::vector<int64_t>> columns_;
+    std::vector<uint8_t> failed_; // rows of the current group that hit an error.
+
+    // Reads a frame, or skips the payload of one longer than MAX_FRAME and sets oversized.
+    static bool read_frame(std::istream &in, std::string &expression, bool &oversized) {
+        uint32_t length;
+        if (!in.read(reinterpret_cast<char*>(&length), sizeof(length))) {
+            return false;
+        }
+        oversized = length > MAX_FRAME;
+        if (oversized) {
+            expression.clear();
+            in.ignore(length);
+            return in.gcount() == static_cast<std::streamsize>(length);
+        }
+        expression.resize(length);
+        return static_cast<bool>(in.read(&expression[0], length));
+    }
+
+    // Tells whether another frame arrives before the deadline.
+    bool pending(std::istream &in, std::chrono::steady_clock::time_point deadline) const {
+        if (in.rdbuf()->in_avail() > 0) {
+            return true;
+        }
+        auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now());
+        if (remaining.count() <= 0) {
+            return false;
+        }
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(fd_, &readable);
+        timeval timeout = {static_cast<time_t>(remaining.count() / 1000000), static_cast<suseconds_t>(remaining.count() % 1000000)};
+        return select(fd_ + 1, &readable, nullptr, nullptr, &timeout) > 0;
+    }
+
+    void respond(FrameResponse &response, int64_t value) {
+        response.value = value;
+        try {
+            converter.to_roman(value, roman_);
+            response.length = roman_.size();
+            std::memcpy(response.roman, roman_.data(), roman_.size());
+        } catch (CalcError &e) {
+            response.error = static_cast<uint8_t>(e.code());
+        }
+    }
+
+    // Applies an operator row by row, apply() inlines to a plain loop for all but a division.
+    // A row stops at its first error, as the sequential fold does, so a division never sees
+    // the operands of a row that already failed.
+    template <char Symbol>
+    void combine(std::vector<int64_t> &left, const std::vector<int64_t> &right, const std::vector<std::size_t> &rows) {
+        for (std::size_t i = 0; i < rows.size(); i++) {
+            if (failed_[i]) {
+                continue;
+            }
+            ErrorCode error = apply<Symbol>(left[i], right[i]);
+            if (error != ErrorCode::NONE) {
+                failed_[i] = 1;
+                responses_[rows[i]].error = static_cast<uint8_t>(error);
+            }
+        }
+    }
+
+    void solve_columns(const std::string &shape, const std::vector<std::size_t> &rows) {
+        StageTimer timer(Stage::SOLVE);
+        std::size_t size = rows.size(), depth = 0, literal = 0;
+        failed_.assign(size, 0);
+        for (char symbol : shape) {
+            if (symbol == 'n') {
+                if (columns_.size() == depth) {
+                    columns_.emplace_back();
+                }
+                std::vector<int64_t> &column = columns_[depth++];
+                column.resize(size);
+                for (std::size_t i = 0; i < size; i++) {
+                    column[i] = literals_[literal_begin_[rows[i]] + literal];
+                }
+                literal++;
+                continue;
+            }
+            if (depth < 2) {
+                for (std::size_t i = 0; i < size; i++) {
+                    if (!failed_[i]) {
+                        responses_[rows[i]].error = static_cast<uint8_t>(ErrorCode::INVALID_FORMAT);
+                    }
+                }
+                return;
+            }
+            const std::vector<int64_t> &right = columns_[--depth];
+            std::vector<int64_t> &left = columns_[depth - 1];
+            switch (symbol) {
+                case '+':
+                    combine<'+'>(left, right, rows);
+                    break;
+                case '-':
+                    combine<'-'>(left, right, rows);
+                    break;
+                case '*':
+                    combine<'*'>(left, right, rows);
+                    break;
+                default:
+                    combine<'/'>(left, right, rows);
+                    break;
+            }
+        }
+        for (std::size_t i = 0; i < size; i++) {
+            if (!failed_[i]) {
+                respond(responses_[rows[i]], depth ? columns_[0][i] : 0);
+            }
+        }
+    }
+
+    void answer(std::size_t count) {
+        for (const ShapeCache::Shape* shape : used_) {
+            shape_rows_[shape->id].clear();
+        }
+        used_.clear();
+        groups_.clear();
+        literals_.clear();
+        for (std::size_t row = 0; row < count; row++) {
+            StageTimer timer(Stage::TOTAL);
+            responses_[row] = {};
+            if (oversized_[row]) {
+                responses_[row].error = static_cast<uint8_t>(ErrorCode::FRAME_TOO_LARGE);
+                continue;
+            }
+            try {
+                solver_.reset(frames_[row]);
+            } catch (CalcError &e) {
+                responses_[row].error = static_cast<uint8_t>(e.code());
+                responses_[row].position = e.position();
+                continue;
+            }
+            const ShapeCache::Shape* shape = solver_.shape();
+            shape_.clear();
+            literal_begin_[row] = literals_.size();
+            for (const Element &element : solver_.rpn()) {
+                if (element.label() == ElementType::VALUE) {
+                    literals_.push_back(element.value());
+                    if (!shape) {
+                        shape_ += 'n';
+                    }
+                } else if (!shape) {
+                    shape_ += static_cast<char>(element.value());
+                }
+            }
+            if (!shape) {
+                groups_[shape_].push_back(row);
+                continue;
+            }
+            if (shape_rows_.size() <= shape->id) {
+                shape_rows_.resize(shape->id + 1);
+            }
+            if (shape_rows_[shape->id].empty()) {
+                used_.push_back(shape);
+            }
+            shape_rows_[shape->id].push_back(row);
+        }
+        for (const ShapeCache::Shape* shape : used_) {
+            solve_columns(shape->program, shape_rows_[shape->id]);
+        }
+        for (const auto &group : groups_) {
+            solve_columns(group.first, group.second);
+        }
+    }
+public:
+    BinaryServer(bool strict = false) {
+        solver_.set_strict(strict);
+    }
+
+    void set_batching(std::size_t frames, long window, int fd = STDIN_FILENO) {
+        batch_frames_ = std::max<std::size_t>(1, frames);
+        batch_window_ = std::chrono::microseconds(window);
+        fd_ = fd;
+    }
+
+    FrameResponse evaluate(std::string_view expression) {
+        StageTimer timer(Stage::TOTAL);
+        FrameResponse response = {};
+        try {
+            solver_.reset(expression);
+            response.value = solver_.compute();
+            converter.to_roman(response.value, roman_);
+            response.length = roman_.size();
+            std::memcpy(response.roman, roman_.data(), roman_.size());
+        } catch (CalcError &e) {
+            response.error = static_cast<uint8_t>(e.code());
+            response.position = e.position();
+        }
+        return response;
+    }
+
+    void serve(std::istream &in, std::ostream &out) {
+        if (batch_frames_ > 1) {
+            serve_batches(in, out);
+            return;
+        }
+        std::string expression;
+        bool oversized;
+        while (read_frame(in, expression, oversized)) {
+            FrameResponse response = {};
+            if (oversized) {
+                response.error = static_cast<uint8_t>(ErrorCode::FRAME_TOO_LARGE);
+            } else {
+                response = evaluate(expression);
+            }
+            out.write(reinterpret_cast<const char*>(&response), sizeof(response));
+            if (in.rdbuf()->in_avail() <= 0) {
+                out.flush();
+            }
+            Instrumentation::dump_if_requested(std::cerr);
+        }
+        out.flush();
+    }
+
+    void serve_batches(std::istream &in, std::ostream &out) {
+        frames_.resize(batch_frames_);
+        oversized_.resize(batch_frames_);
+        responses_.resize(batch_frames_);
+        literal_begin_.resize(batch_frames_);
+        while (true) {
+            std::size_t count = 0;
+            auto deadline = std::chrono::steady_clock::now();
+            bool oversized;
+            while (count < batch_frames_ && read_frame(in, frames_[count], oversized)) {
+                oversized_[count] = oversized;
+                if (count++ == 0) {
+                    deadline = std::chrono::steady_clock::now() + batch_window_;
+                }
+                if (count < batch_frames_ && !pending(in, deadline)) {
+                    break;
+                }
+            }
+            if (count == 0) {
+                break;
+            }
+            answer(count);
+            out.write(reinterpret_cast<const char*>(responses_.data()), count * sizeof(FrameResponse));
+            out.flush();
+            Instrumentation::dump_if_requested(std::cerr);
+        }
+    }
+};
+
+/**
+ * @class SpanMemo
+ * Values of the bracketed spans of a batch's lines, so a term repeated over many lines is
+ * tokenized and solved once. A line is solved token by token with an EagerParser. At an opening
+ * bracket the text up to its matching bracket is looked up by the Fingerprint of its
+ * non-whitespace bytes, checked against the text itself; on a hit the span is not tokenized at
+ * all, its value is pushed as one operand and the tokenizer is moved past the closing bracket.
+ * A span seen for the first time is solved on a parser of its own, its inner spans looked up the
+ * same way, and is remembered as clean when that leaves exactly one operand and no failed
+ * operator. Any other span is remembered as such and its tokens are pushed to the enclosing
+ * parser as they are, so errors, their order and the quirks of malformed spans come out exactly
+ * as ExpressionSolver reports them. Spans longer than MAX_SPAN bytes or nested deeper than
+ * MAX_DEPTH are not looked up, their inner spans are.
+ * 
+ * Methods:
+ * void set_strict(bool strict) // turns rejection of non-canonical numerals on or off, forgets all spans on a change.
+ * int64_t evaluate(std::string_view line) // solves a line, throws its error.
+ * void clear() // forgets all spans.
+ * std::size_t size() // number of remembered spans.
+ * uint64_t reused() // number of spans answered without tokenizing them.
+ */
+class SpanMemo {
+public:
+    static constexpr std::size_t MAX_SPAN = 4096, MAX_DEPTH = 64;
+private:
+    struct Span {
+        std::string text; // text between the brackets, as first seen.
+        int64_t value;
+        int length; // non-whitespace characters between the brackets.
+        bool clean;
+    };
+
+    static constexpr std::size_t NONE = SIZE_MAX;
+
+    bool strict_ = false;
+    std::unordered_map<uint64_t, Span> spans_;
+    std::vector<std::size_t> opens_, closes_; // offset of every '(' of the line and of its matching ')', NONE if unmatched.
+    std::vector<std::size_t> unmatched_; // helpful stack of indexes in opens_.
+    std::size_t next_ = 0; // index in opens_ of the next '(' the tokenizer reaches.
+    EagerParser parser_;
+    EagerParser inner_[MAX_DEPTH]; // parser of the span being solved at every depth.
+    uint64_t reused_ = 0;
+
+    void match(std::string_view line) {
+        opens_.clear();
+        closes_.clear();
+        unmatched_.clear();
+        next_ = 0;
+        for (std::size_t i = 0; i < line.size(); i++) {
+            if (line[i] == '(') {
+                unmatched_.push_back(opens_.size());
+                opens_.push_back(i);
+                closes_.push_back(NONE);
+            } else if (line[i] == ')' && !unmatched_.empty()) {
+                closes_[unmatched_.back()] = i;
+                unmatched_.pop_back();
+            }
+        }
+    }
+
+    // Pushes the tokens up to the one at offset end to parser, returns that token or TokenType::END.
+    Token feed(std::string_view line, Tokenizer &tokenizer, EagerParser &parser, std::size_t end, std::size_t depth) {
+        while (true) {
+            Token token = tokenizer.next();
+            if (token.type == TokenType::END || token.begin == end) {
+                return token;
+            }
+            if (token.type == TokenType::OPEN_BRACKET) {
+                std::size_t close = closes_[next_++];
+                if (close != NONE && span(line, tokenizer, parser, token, close, depth)) {
+                    continue;
+                }
+            }
+            parser.push(token);
+        }
+    }
+
+    // Solves the span opened by open and closed at offset close into one operand of parser,
+    // false if the tokenizer is back after open and the span's tokens are to be pushed as they are.
+    bool span(std::string_view line, Tokenizer &tokenizer, EagerParser &parser, const Token &open, std::size_t close, std::size_t depth) {
+        if (depth == MAX_DEPTH || close - open.end > MAX_SPAN) {
+            return false;
+        }
+        std::string_view text = line.substr(open.end, close - open.end);
+        uint64_t fingerprint = Fingerprint::of(text);
+        auto found = spans_.find(fingerprint);
+        bool known = found != spans_.end();
+        if (known && same_text(found->second.text, text)) {
+            if (!found->second.clean) {
+                return false;
+            }
+            reused_++;
+            tokenizer.seek(close + 1, open.position + found->second.length + 1, CharClass::CLOSE_BRACKET);
+            while (next_ < opens_.size() && opens_[next_] < close) {
+                next_++;
+            }
+            parser.push_operand(found->second.value);
+            return true;
+        }
+
+        EagerParser &inner = inner_[depth];
+        inner.clear();
+        std::size_t first = next_;
+        Token last = feed(line, tokenizer, inner, close, depth + 1);
+        int64_t value = 0;
+        bool clean = inner.solved(value);
+        if (!known) {
+            spans_.emplace(fingerprint, Span{std::string(text), value, last.position - open.position - 1, clean});
+        }
+        if (!clean) {
+            tokenizer.seek(open.end, open.position, CharClass::OPEN_BRACKET);
+            next_ = first;
+            return false;
+        }
+        parser.push_operand(value);
+        return true;
+    }
+public:
+    void set_strict(bool strict) {
+        if (strict != strict_) {
+            strict_ = strict;
+            spans_.clear();
+        }
+    }
+
+    int64_t evaluate(std::string_view line) {
+        match(line);
+        parser_.clear();
+        Tokenizer tokenizer(line, strict_);
+        feed(line, tokenizer, parser_, NONE, 0);
+        return parser_.finish();
+    }
+
+    void clear() {
+        spans_.clear();
+    }
+
+    std::size_t size() const {
+        return spans_.size();
+    }
+
+    uint64_t reused() const {
+        return reused_;
+    }
+};
+
+/**
+ * @class BatchEvaluator
+ * Evaluates text input on the shared TaskPool and prints the results in input order. Lines are
+ * read in batches of up to BATCH_LINES lines; small lines go to tasks of up to TASK_LINES
+ * lines or TASK_BYTES bytes, so millions of tiny expressions do not drown in scheduling, while
+ * every line of ExpressionSolver::PARALLEL_THRESHOLD bytes or more becomes a task of its own,
+ * whose parse and evaluation fork further subtasks. Idle threads steal whatever is left.
+ * With deduplication on, every batch is first reduced to its distinct lines: a line is keyed by
+ * the Fingerprint of its text without whitespace, which changes neither its value nor its error
+ * positions, the first line of every key is evaluated once and its result scattered back in
+ * input order. Lines whose fingerprints collide are told apart by comparing their text.
+ * With the span memo on, lines are solved through a SpanMemo per thread, emptied at the start
+ * of every batch, so bracketed terms shared by the lines a thread gets are solved once.
+ * 
+ * Methods:
+ * BatchEvaluator(bool strict, unsigned threads) // strict rejects non-canonical numerals, threads splits huge expressions.
+ * void set_dedup(bool dedup) // turns the deduplication pass on or off.
+ * void set_memo(bool memo) // turns solving through a SpanMemo on or off.
+ * void serve(std::istream &in, std::ostream &out) // answers all lines of the input.
+ */
+class BatchEvaluator {
+private:
+    static constexpr std::size_t BATCH_LINES = 1 << 16;
+    static constexpr std::size_t TASK_LINES = 256;
+    static constexpr std::size_t TASK_BYTES = 1 << 16;
+
+    bool strict_;
+    unsigned threads_;
+    bool dedup_ = false, memo_ = false;
+    uint64_t batch_ = 0; // number of the current batch.
+    std::vector<std::string> lines_, results_;
+    std::vector<std::string_view> inputs_; // lines evaluated into results_.
+    std::vector<std::size_t> slot_; // index of every line's result in results_.
+    std::unordered_map<uint64_t, std::size_t> index_; // slot of every distinct line by fingerprint.
+
+    void evaluate(std::size_t begin, std::size_t end) {
+        static thread_local ExpressionSolver solver;
+        static thread_local SpanMemo memo;
+        static thread_local uint64_t memo_batch = 0;
+        static thread_local RomanConverter converter;
+        solver.set_strict(strict_);
+        solver.set_threads(threads_);
+        memo.set_strict(strict_);
+        if (memo_ && memo_batch != batch_) {
+            memo.clear();
+            memo_batch = batch_;
+        }
+        for (std::size_t i = begin; i < end; i++) {
+            try {
+                StageTimer timer(Stage::TOTAL);
+                if (memo_) {
+                    converter.to_roman(memo.evaluate(inputs_[i]), results_[i]);
+                } else {
+                    results_[i] = solver.evaluate(inputs_[i]);
+                }
+            } catch (std::logic_error &e) {
+                results_[i] = std::string("error: ") + e.what();
+            }
+        }
+    }
+
+    // Collects the distinct lines of the batch into inputs_, returns their number.
+    std::size_t deduplicate(std::size_t count) {
+        index_.clear();
+        std::size_t distinct = 0;
+        for (std::size_t i = 0; i < count; i++) {
+            auto inserted = index_.emplace(Fingerprint::of(lines_[i]), distinct);
+            if (!inserted.second && same_text(inputs_[inserted.first->second], lines_[i])) {
+                slot_[i] = inserted.first->second;
+                continue;
+            }
+            inputs_[distinct] = lines_[i];
+            slot_[i] = distinct++;
+        }
+        return distinct;
+    }
+
+    void submit(TaskGroup &group, std::size_t begin, std::size_t end) {
+        if (begin < end) {
+            TaskPool::shared().submit(group, [this, begin, end] {
+                evaluate(begin, end);
+            });
+        }
+    }
+public:
+    BatchEvaluator(bool strict, unsigned threads) : strict_(strict), threads_(threads) {}
+
+    void set_dedup(bool dedup) {
+        dedup_ = dedup;
+    }
+
+    void set_memo(bool memo) {
+        memo_ = memo;
+    }
+
+    void serve(std::istream &in, std::ostream &out) {
+        lines_.resize(BATCH_LINES);
+        results_.resize(BATCH_LINES);
+        inputs_.resize(BATCH_LINES);
+        slot_.resize(BATCH_LINES);
+        while (in) {
+            std::size_t count = 0;
+            while (count < BATCH_LINES && std::getline(in, lines_[count])) {
+                inputs_[count] = lines_[count];
+                slot_[count] = count;
+                count++;
+            }
+            std::size_t lines = dedup_ ? deduplicate(count) : count;
+            batch_++;
+
+            TaskGroup group;
+            std::size_t begin = 0, bytes = 0;
+            for (std::size_t i = 0; i < lines; i++) {
+                std::string_view line = inputs_[i];
+                if (line.size() >= ExpressionSolver::PARALLEL_THRESHOLD) {
+                    submit(group, begin, i);
+                    submit(group, i, i + 1);
+                    begin = i + 1;
+                    bytes = 0;
+                } else if (i + 1 - begin == TASK_LINES || (bytes += line.size()) >= TASK_BYTES) {
+                    submit(group, begin, i + 1);
+                    begin = i + 1;
+                    bytes = 0;
+                }
+            }
+            submit(group, begin, lines);
+            TaskPool::shared().wait(group);
+
+            for (std::size_t i = 0; i < count; i++) {
+                out << results_[slot_[i]] << '\n';
+            }
+            out.flush();
+            Instrumentation::dump_if_requested(std::cerr);
+        }
+    }
+};
+
+/**
+ * @class StoreHeader
+ * Header of a compiled formula store, the file FormulaSheet::save() writes and FormulaStore maps.
+ * Every section is addressed by its offset from the start of the file, so the file works at any
+ * address; numbers are in host byte order, like the binary protocol. Sections, in file order:
+ * literals // int64_t literal table, 8-byte aligned.
+ * entries // one StoreEntry per formula.
+ * index // index_slots uint32_t formula numbers, an open addressing table keyed by Fingerprint::of(name), UINT32_MAX marks an empty slot.
+ * code // bytecode of all formulas.
+ * strings // names of all formulas.
+ * A formula's bytecode is its Reverse Polish notation, a byte per element: '+', '-', '*' and '/'
+ * are operators, 'n' pushes the formula's next literal and 'r' pushes the value of the formula
+ * numbered |literal| - 1, negated when the literal is negative.
+ */
+struct StoreHeader {
+    static constexpr char MAGIC[8] = {'R', 'O', 'M', 'S', 'T', 'O', 'R', 'E'};
+    static constexpr uint32_t VERSION = 1;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t formulas;
+    uint32_t index_slots;
+    uint32_t literal_count;
+    uint64_t literals, entries, index, code, strings, size; // size is the size of the whole file.
+};
+
+/**
+ * @class StoreEntry
+ * A formula of a compiled formula store.
+ * 
+ * Fields:
+ * name, name_length // formula's name in the strings section.
+ * code, code_length // formula's bytecode in the code section.
+ * literal // number of the formula's first literal.
+ * error // ErrorCode::UNDEFINED_NAME for a name that is referenced but never defined, ErrorCode::NONE otherwise.
+ */
+struct StoreEntry {
+    uint32_t name, name_length;
+    uint32_t code, code_length;
+    uint32_t literal;
+    uint8_t error;
+    uint8_t reserved[3];
+};
+
+/**
+ * @class FormulaSheet
+ * Named formulas referencing each other, spreadsheet style: "TOTAL = A + B*X". A name is a run of
+ * letters, digits and underscores that starts with a letter or an underscore and is not made of
+ * numeral letters only, so X above is ten. A formula is compiled once into Reverse Polish notation
+ * whose literals stand for the names it references, and the sheet keeps the graph of references:
+ * defining a formula recomputes it and the formulas depending on it, each once, in topological
+ * order, and leaves the rest alone. A name used before it is defined is an error until it is
+ * defined, a formula using a failed one fails the same way, and definitions closing a cycle of
+ * references are rejected.
+ * 
+ * Methods:
+ * FormulaSheet(bool strict) // strict rejects non-canonical numerals.
+ * const std::vector<uint32_t>& define(std::string_view name, std::string_view expression) // (re)defines a formula, returns the recomputed ones in computation order.
+ * int64_t evaluate(std::string_view expression) // solves an expression over the formulas without defining or adding anything.
+ * const std::string& name(uint32_t formula) // returns a formula's name.
+ * int64_t value(uint32_t formula) // returns a formula's value, throws its error.
+ * void save(std::ostream &out) // writes the formulas as a compiled formula store, see StoreHeader.
+ * void serve(std::istream &in, std::ostream &out) // defines "NAME = expression" lines, printing the recomputed formulas as "NAME = value", and solves other lines.
+ */
+class FormulaSheet {
+private:
+    // A literal of a formula's RPN standing for a name; the literal is 1 or -1 for a unary minus.
+    struct Slot {
+        std::size_t element;
+        uint32_t formula;
+    };
+
+    struct Formula {
+        std::string name;
+        std::vector<Element> rpn;
+        std::vector<Slot> slots; // ordered by element.
+        std::vector<uint32_t> dependencies, dependents; // formulas this one references and the ones referencing it.
+        int64_t value = 0;
+        bool defined = false;
+        ErrorCode error = ErrorCode::NONE;
+        std::string message; // error's message.
+    };
+
+    // A name in an expression being compiled.
+    struct Reference {
+        std::size_t offset; // offset of its placeholder in rewritten_.
+        int position; // non-whitespace position of its placeholder in rewritten_.
+        int length; // length of the name.
+        uint32_t formula;
+    };
+
+    ExpressionSolver solver_;
+    RomanConverter converter_;
+    std::vector<Formula> formulas_;
+    std::unordered_map<std::string, uint32_t> index_; // formula of every name.
+    std::vector<uint32_t> order_; // formulas recomputed by the last define().
+    std::vector<uint64_t> visited_; // epoch_ of the last traversal that reached every formula.
+    uint64_t epoch_ = 0;
+    std::vector<std::pair<uint32_t, std::size_t>> path_; // formulas of a depth-first traversal with their next edge.
+    std::vector<int64_t> stack_;
+    std::string rewritten_; // expression being compiled, every name replaced by the numeral I.
+    std::vector<Reference> references_;
+
+    static bool is_name_char(char c) {
+        return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_';
+    }
+
+    static bool is_name(std::string_view run) {
+        if (run.empty() || (run[0] >= '0' && run[0] <= '9')) {
+            return false;
+        }
+        return std::all_of(run.begin(), run.end(), is_name_char) &&
+               !std::all_of(run.begin(), run.end(), [](char c) { return char_table[c].type == CharClass::NUMERAL; });
+    }
+
+    // Returns the formula of a name, adding an undefined one for a new name.
+    uint32_t find(std::string_view name) {
+        auto inserted = index_.emplace(std::string(name), static_cast<uint32_t>(formulas_.size()));
+        if (inserted.second) {
+            Formula formula;
+            formula.name = name;
+            formula.error = ErrorCode::UNDEFINED_NAME;
+            formula.message = "Undefined name " + formula.name;
+            formulas_.push_back(std::move(formula));
+            visited_.push_back(0);
+        }
+        return inserted.first->second;
+    }
+
+    // Drops the formulas find() added after the first count ones. Queries and rejected definitions
+    // call it, so only names of successful definitions stay in the sheet.
+    void forget(std::size_t count) {
+        for (std::size_t formula = count; formula < formulas_.size(); formula++) {
+            index_.erase(formulas_[formula].name);
+        }
+        formulas_.resize(count);
+        visited_.resize(count);
+    }
+
+    // Rewrites the names of an expression into references_ and placeholders in rewritten_.
+    void rewrite(std::string_view expression) {
+        rewritten_.clear();
+        references_.clear();
+        int position = 0, original = 0; // non-whitespace characters in rewritten_ and expression.
+        bool numeral = false, name = false; // whether the last non-whitespace character ends a numeral or a name.
+        for (std::size_t i = 0; i < expression.size();) {
+            std::size_t end = i;
+            while (end < expression.size() && is_name_char(expression[end])) {
+                end++;
+            }
+            std::string_view run = expression.substr(i, std::max(end, i + 1) - i);
+            if (is_space(run[0])) {
+                rewritten_ += run[0];
+                i++;
+                continue;
+            }
+            bool reference = is_name(run);
+            if ((reference && numeral) || (name && char_table[run[0]].type == CharClass::NUMERAL)) {
+                throw CalcError(ErrorCode::BAD_SYMBOL, "Bad symbol on position " + std::to_string(original + 1), original + 1);
+            }
+            if (reference) {
+                references_.push_back({rewritten_.size(), position + 1, static_cast<int>(run.size()), find(run)});
+                rewritten_ += 'I';
+                position++;
+            } else {
+                rewritten_ += run;
+                position += run.size();
+            }
+            original += run.size();
+            numeral = char_table[run.back()].type == CharClass::NUMERAL || reference;
+            name = reference;
+            i += run.size();
+        }
+    }
+
+    // Compiles an expression into a formula's RPN, slots and dependencies.
+    void compile(std::string_view expression, Formula &formula) {
+        rewrite(expression);
+        try {
+            solver_.reset(rewritten_);
+        } catch (CalcError &e) {
+            if (!e.position()) {
+                throw;
+            }
+            int position = e.position();
+            for (const Reference &reference : references_) {
+                if (reference.position < e.position()) {
+                    position += reference.length - 1;
+                }
+            }
+            std::string message = e.what();
+            message.replace(message.rfind(' ') + 1, std::string::npos, std::to_string(position));
+            throw CalcError(e.code(), message, position);
+        }
+        formula.rpn = solver_.rpn();
+        formula.slots.clear();
+        formula.dependencies.clear();
+
+        // Operands keep their order in RPN, so the k-th literal is the expression's k-th numeral.
+        Tokenizer tokenizer(rewritten_);
+        std::size_t element = 0, reference = 0;
+        for (Token token = tokenizer.next(); token.type != TokenType::END && reference < references_.size(); token = tokenizer.next()) {
+            if (token.type != TokenType::NUMBER) {
+                continue;
+            }
+            while (formula.rpn[element].label() != ElementType::VALUE) {
+                element++;
+            }
+            if (token.begin == references_[reference].offset) {
+                formula.slots.push_back({element, references_[reference++].formula});
+            }
+            element++;
+        }
+        for (const Slot &slot : formula.slots) {
+            if (std::find(formula.dependencies.begin(), formula.dependencies.end(), slot.formula) == formula.dependencies.end()) {
+                formula.dependencies.push_back(slot.formula);
+            }
+        }
+    }
+
+    // Solves a formula from the values of the ones it references.
+    void compute(Formula &formula) {
+        formula.error = ErrorCode::NONE;
+        formula.message.clear();
+        for (const Slot &slot : formula.slots) {
+            const Formula &reference = formulas_[slot.formula];
+            if (reference.error != ErrorCode::NONE) {
+                formula.error = reference.error;
+                formula.message = reference.message;
+                return;
+            }
+        }
+
+        stack_.clear();
+        std::size_t slot = 0;
+        for (std::size_t i = 0; i < formula.rpn.size(); i++) {
+            const Element &element = formula.rpn[i];
+            if (element.label() == ElementType::VALUE) {
+                int64_t value = element.value();
+                if (slot < formula.slots.size() && formula.slots[slot].element == i) {
+                    value *= formulas_[formula.slots[slot++].formula].value;
+                }
+                stack_.push_back(value);
+                continue;
+            }
+            ErrorCode error = apply(static_cast<char>(element.value()), stack_);
+            if (error != ErrorCode::NONE) {
+                formula.error = error;
+                formula.message = solve_error(error).what();
+                return;
+            }
+        }
+        formula.value = stack_.empty() ? 0 : stack_[0];
+    }
+
+    // Whether the target is among the formulas or the ones they reference.
+    bool reaches(const std::vector<uint32_t> &formulas, uint32_t target) {
+        epoch_++;
+        std::vector<uint32_t> &pending = order_;
+        pending.assign(formulas.begin(), formulas.end());
+        while (!pending.empty()) {
+            uint32_t formula = pending.back();
+            pending.pop_back();
+            if (formula == target) {
+                return true;
+            }
+            if (visited_[formula] != epoch_) {
+                visited_[formula] = epoch_;
+                pending.insert(pending.end(), formulas_[formula].dependencies.begin(), formulas_[formula].dependencies.end());
+            }
+        }
+        return false;
+    }
+
+    // Recomputes a formula and everything depending on it: order_ becomes the reversed
+    // post-order of a depth-first traversal of the dependents, which is a topological order.
+    void recompute(uint32_t changed) {
+        epoch_++;
+        order_.clear();
+        path_.assign(1, {changed, 0});
+        visited_[changed] = epoch_;
+        while (!path_.empty()) {
+            auto &[formula, edge] = path_.back();
+            const std::vector<uint32_t> &dependents = formulas_[formula].dependents;
+            if (edge == dependents.size()) {
+                order_.push_back(formula);
+                path_.pop_back();
+                continue;
+            }
+            uint32_t next = dependents[edge++];
+            if (visited_[next] != epoch_) {
+                visited_[next] = epoch_;
+                path_.push_back({next, 0});
+            }
+        }
+        std::reverse(order_.begin(), order_.end());
+        for (uint32_t formula : order_) {
+            compute(formulas_[formula]);
+        }
+    }
 public:
-    int64_t to_int64(const std::string &value) {
-        if (value.size() == 1 && value[0] == 'Z') {
-            return 0;
+    FormulaSheet(bool strict = false) {
+        solver_.set_strict(strict);
+    }
+
+    const std::vector<uint32_t>& define(std::string_view name, std::string_view expression) {
+        while (!name.empty() && is_space(name.front())) {
+            name.remove_prefix(1);
+        }
+        while (!name.empty() && is_space(name.back())) {
+            name.remove_suffix(1);
+        }
+        if (!is_name(name)) {
+            throw CalcError(ErrorCode::INVALID_FORMAT, "Invalid formula name");
         }
-        int64_t result = 0;
-        char prev_literal = 0;
 
-        for (char literal : value) {
-            if (prev_literal && rule_add[prev_literal] < rule_add[literal]) {
-                result += rule_div[std::make_pair(prev_literal, literal)];
-            } else {
-                result += rule_add[literal];
+        Formula compiled;
+        std::size_t known = formulas_.size();
+        uint32_t changed;
+        try {
+            compile(expression, compiled);
+            changed = find(name);
+            if (reaches(compiled.dependencies, changed)) {
+                throw CalcError(ErrorCode::CIRCULAR_REFERENCE, "Circular reference to " + std::string(name));
             }
-            prev_literal = literal;
+        } catch (CalcError &) {
+            forget(known);
+            throw;
         }
 
-        return result;
+        for (uint32_t dependency : formulas_[changed].dependencies) {
+            std::vector<uint32_t> &dependents = formulas_[dependency].dependents;
+            dependents.erase(std::find(dependents.begin(), dependents.end(), changed));
+        }
+        for (uint32_t dependency : compiled.dependencies) {
+            formulas_[dependency].dependents.push_back(changed);
+        }
+        Formula &formula = formulas_[changed];
+        formula.rpn = std::move(compiled.rpn);
+        formula.slots = std::move(compiled.slots);
+        formula.dependencies = std::move(compiled.dependencies);
+        formula.defined = true;
+        recompute(changed);
+        return order_;
     }
 
-    std::string to_roman(int64_t value) {
-        if (!value) {
-            return "Z";
+    int64_t evaluate(std::string_view expression) {
+        Formula formula;
+        std::size_t known = formulas_.size();
+        try {
+            compile(expression, formula);
+        } catch (CalcError &) {
+            forget(known);
+            throw;
         }
-        if (std::abs(value) > BOUND) {
-            throw std::logic_error("Roman number overflow");
+        compute(formula);
+        forget(known);
+        if (formula.error != ErrorCode::NONE) {
+            throw CalcError(formula.error, formula.message);
         }
-        std::string result = "";
+        return formula.value;
+    }
 
-        if (value < 0) {
-            result = "-";
-            value = abs(value);
+    const std::string& name(uint32_t formula) const {
+        return formulas_[formula].name;
+    }
+
+    int64_t value(uint32_t formula) const {
+        if (formulas_[formula].error != ErrorCode::NONE) {
+            throw CalcError(formulas_[formula].error, formulas_[formula].message);
         }
+        return formulas_[formula].value;
+    }
 
-        while (value > 0) {
-            for (auto w : weight) {
-                if (value >= w.first) {
-                    value -= w.first;
-                    result += w.second;
-                    break;
+    void save(std::ostream &out) const {
+        uint32_t slots = 16;
+        while (slots < 2 * formulas_.size()) {
+            slots *= 2;
+        }
+        std::vector<int64_t> literals;
+        std::vector<StoreEntry> entries(formulas_.size());
+        std::vector<uint32_t> index(slots, UINT32_MAX);
+        std::string code, strings;
+        for (uint32_t id = 0; id < formulas_.size(); id++) {
+            const Formula &formula = formulas_[id];
+            StoreEntry &entry = entries[id];
+            entry.name = strings.size();
+            entry.name_length = formula.name.size();
+            entry.code = code.size();
+            entry.literal = literals.size();
+            entry.error = static_cast<uint8_t>(formula.defined ? ErrorCode::NONE : ErrorCode::UNDEFINED_NAME);
+            strings += formula.name;
+            std::size_t slot = 0;
+            for (std::size_t i = 0; i < formula.rpn.size(); i++) {
+                const Element &element = formula.rpn[i];
+                if (element.label() != ElementType::VALUE) {
+                    code += static_cast<char>(element.value());
+                } else if (slot < formula.slots.size() && formula.slots[slot].element == i) {
+                    code += 'r';
+                    literals.push_back(element.value() * (formula.slots[slot++].formula + int64_t(1)));
+                } else {
+                    code += 'n';
+                    literals.push_back(element.value());
                 }
             }
+            entry.code_length = code.size() - entry.code;
+            std::size_t at = Fingerprint::of(formula.name) & (slots - 1);
+            while (index[at] != UINT32_MAX) {
+                at = (at + 1) & (slots - 1);
+            }
+            index[at] = id;
         }
-        return result;
+
+        StoreHeader header = {};
+        std::memcpy(header.magic, StoreHeader::MAGIC, sizeof(header.magic));
+        header.version = StoreHeader::VERSION;
+        header.formulas = formulas_.size();
+        header.index_slots = slots;
+        header.literal_count = literals.size();
+        header.literals = sizeof(StoreHeader);
+        header.entries = header.literals + literals.size() * sizeof(int64_t);
+        header.index = header.entries + entries.size() * sizeof(StoreEntry);
+        header.code = header.index + index.size() * sizeof(uint32_t);
+        header.strings = header.code + code.size();
+        header.size = header.strings + strings.size();
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(literals.data()), literals.size() * sizeof(int64_t));
+        out.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(StoreEntry));
+        out.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(uint32_t));
+        out << code << strings;
     }
-};
 
-/**
- * @class ElementType
- * The class lists all the possible elements of our expressions.
- */
-enum class ElementType {
-    BRACKET,
-    BINARY_OPERATION,
-    VALUE
+    void serve(std::istream &in, std::ostream &out) {
+        std::string line, roman;
+        while (std::getline(in, line)) {
+            std::size_t equals = line.find('=');
+            try {
+                if (equals == std::string::npos) {
+                    StageTimer timer(Stage::TOTAL);
+                    converter_.to_roman(evaluate(line), roman);
+                    out << roman << std::endl;
+                    continue;
+                }
+                std::string_view view = line;
+                for (uint32_t formula : define(view.substr(0, equals), view.substr(equals + 1))) {
+                    out << name(formula) << " = ";
+                    try {
+                        converter_.to_roman(value(formula), roman);
+                        out << roman << '\n';
+                    } catch (std::logic_error &e) {
+                        out << "error: " << e.what() << '\n';
+                    }
+                }
+                out.flush();
+            } catch (std::logic_error &e) {
+                out << "error: " << e.what() << std::endl;
+            }
+            Instrumentation::dump_if_requested(std::cerr);
+        }
+    }
 };
 
 /**
- * @class Element
- * Class describing the elements of an arithmetic expression
+ * @class FormulaStore
+ * Compiled formulas of a store file written by FormulaSheet::save(), used where they lie: the file
+ * is mapped read-only and names are looked up in its index and solved straight from its bytecode,
+ * so loading costs a few system calls and one pass over the index, which must leave a lookup an
+ * empty slot to stop at. A formula's value is computed on its first request, together with the
+ * formulas it references, and remembered; a request failing on a damaged store or a circular
+ * reference leaves no formula half visited.
  * 
  * Methods:
- * Element(int64_t value) // constructor for value-type element.
- * Element(int value, ElementType type) // constructor for brackets and binary operators.
- * ElementType label() // returns current element's type.
- * int priority() // returnst current element's priority.
- * Element* proceed(Element* left, Element* right) // proceeds a given operation for two values. Uses only for binary operations.
- * int64_t value() // returns current elemnt's value.
+ * FormulaStore(std::string_view data) // uses a store already in memory, which must outlive the store.
+ * static std::unique_ptr<FormulaStore> open(const std::string &path) // maps a store file.
+ * std::size_t size() // number of formulas.
+ * int64_t value(std::string_view name) // solves a formula, throws its error.
+ * void serve(std::istream &in, std::ostream &out) // prints the value or error of the formula named by every line.
  */
-class Element {
-public:
-    Element(int64_t value) : value_(value), label_(ElementType::VALUE), priority_(3) {}
+class FormulaStore {
+private:
+    std::string_view data_;
+    void* mapping_ = nullptr; // mapped file, if the store maps one.
+    const StoreHeader* header_;
+    const int64_t* literals_;
+    const StoreEntry* entries_;
+    const uint32_t* index_;
+    const char* code_;
+    const char* strings_;
 
-    Element(int value, ElementType type) : value_(value), label_(type) {
-        switch (value) {
-            case '+':
-            case '-':
-                priority_ = 0;
-                break;
+    enum State : uint8_t { NEW, VISITING, DONE };
+    std::vector<State> states_;
+    std::vector<int64_t> values_;
+    std::vector<ErrorCode> errors_;
+    std::vector<uint32_t> origins_; // formula every error comes from.
+    std::vector<uint32_t> pending_;
+    std::vector<int64_t> stack_;
+    RomanConverter converter;
 
-            case '*':
-            case '/':
-                priority_ = 1;
-                break;
+    static void check(bool valid) {
+        if (!valid) {
+            throw std::runtime_error("Invalid formula store");
+        }
+    }
 
-            case '(':
-            case ')':
-                priority_ = -1;
-                break;
-            
-            default:
-                break;
+    // Returns a formula's entry, checking that it lies within the store.
+    const StoreEntry& entry(uint32_t formula) const {
+        check(formula < header_->formulas);
+        const StoreEntry &entry = entries_[formula];
+        check(uint64_t(entry.name) + entry.name_length <= header_->size - header_->strings &&
+              uint64_t(entry.code) + entry.code_length <= header_->strings - header_->code &&
+              entry.literal <= header_->literal_count);
+        return entry;
+    }
+
+    std::string_view name(uint32_t formula) const {
+        return std::string_view(strings_ + entries_[formula].name, entries_[formula].name_length);
+    }
+
+    // Number of the formula a reference literal names.
+    uint32_t referenced(int64_t literal) const {
+        uint64_t formula = (literal < 0 ? -static_cast<uint64_t>(literal) : literal) - 1;
+        check(formula < header_->formulas);
+        return formula;
+    }
+
+    void fail(uint32_t formula, ErrorCode error, uint32_t origin) {
+        errors_[formula] = error;
+        origins_[formula] = origin;
+    }
+
+    // Solves a formula whose references are solved.
+    void solve(uint32_t formula) {
+        const StoreEntry &entry = entries_[formula];
+        const char* code = code_ + entry.code;
+        const int64_t* literals = literals_ + entry.literal;
+        if (entry.error != static_cast<uint8_t>(ErrorCode::NONE)) {
+            return fail(formula, static_cast<ErrorCode>(entry.error), formula);
         }
+        for (uint32_t i = 0, literal = 0; i < entry.code_length; i++) {
+            if (code[i] == 'n') {
+                literal++;
+            } else if (code[i] == 'r') {
+                uint32_t reference = referenced(literals[literal++]);
+                if (errors_[reference] != ErrorCode::NONE) {
+                    return fail(formula, errors_[reference], origins_[reference]);
+                }
+            }
+        }
+
+        stack_.clear();
+        for (uint32_t i = 0, literal = 0; i < entry.code_length; i++) {
+            char symbol = code[i];
+            if (symbol == 'n') {
+                stack_.push_back(literals[literal++]);
+                continue;
+            } else if (symbol == 'r') {
+                int64_t reference = literals[literal++];
+                stack_.push_back(reference < 0 ? -values_[referenced(reference)] : values_[referenced(reference)]);
+                continue;
+            }
+            ErrorCode error = apply(symbol, stack_);
+            if (error != ErrorCode::NONE) {
+                return fail(formula, error, formula);
+            }
+        }
+        values_[formula] = stack_.empty() ? 0 : stack_[0];
     }
 
-    ElementType label() const {
-        return label_;
+    // Solves a formula after the ones it references, depth first without recursion.
+    void compute(uint32_t formula) {
+        pending_.assign(1, formula);
+        try {
+            visit();
+        } catch (...) {
+            // Every formula left half visited is pending; a later request starts it over.
+            for (uint32_t current : pending_) {
+                if (states_[current] == VISITING) {
+                    states_[current] = NEW;
+                }
+            }
+            throw;
+        }
     }
 
-    int priority() const {
-        return priority_;
+    // Solves the pending formulas, every one after the formulas it references.
+    void visit() {
+        while (!pending_.empty()) {
+            uint32_t current = pending_.back();
+            if (states_[current] == DONE) {
+                pending_.pop_back();
+            } else if (states_[current] == VISITING) {
+                solve(current);
+                states_[current] = DONE;
+                pending_.pop_back();
+            } else {
+                states_[current] = VISITING;
+                const StoreEntry &entry = this->entry(current);
+                for (uint32_t i = 0, literal = entry.literal; i < entry.code_length; i++) {
+                    char symbol = code_[entry.code + i];
+                    check(symbol == 'n' || symbol == 'r' || char_table[symbol].type == CharClass::OPERATION);
+                    check(!(symbol == 'n' || symbol == 'r') || literal < header_->literal_count);
+                    if (symbol == 'r') {
+                        uint32_t reference = referenced(literals_[literal]);
+                        if (states_[reference] == VISITING) {
+                            throw CalcError(ErrorCode::CIRCULAR_REFERENCE, "Circular reference to " + std::string(name(reference)));
+                        }
+                        pending_.push_back(reference);
+                    }
+                    literal += symbol == 'n' || symbol == 'r';
+                }
+            }
+        }
+    }
+public:
+    FormulaStore(std::string_view data) : data_(data) {
+        check(data.size() >= sizeof(StoreHeader) && reinterpret_cast<uintptr_t>(data.data()) % alignof(int64_t) == 0);
+        header_ = reinterpret_cast<const StoreHeader*>(data.data());
+        check(std::memcmp(header_->magic, StoreHeader::MAGIC, sizeof(header_->magic)) == 0 && header_->version == StoreHeader::VERSION);
+        const StoreHeader &header = *header_;
+        check(header.size == data.size() && header.literals == sizeof(StoreHeader) &&
+              header.entries == header.literals + uint64_t(header.literal_count) * sizeof(int64_t) &&
+              header.index == header.entries + uint64_t(header.formulas) * sizeof(StoreEntry) &&
+              header.code == header.index + uint64_t(header.index_slots) * sizeof(uint32_t) &&
+              header.code <= header.strings && header.strings <= header.size &&
+              header.index_slots && !(header.index_slots & (header.index_slots - 1)) && header.index_slots > header.formulas);
+        literals_ = reinterpret_cast<const int64_t*>(data.data() + header.literals);
+        entries_ = reinterpret_cast<const StoreEntry*>(data.data() + header.entries);
+        index_ = reinterpret_cast<const uint32_t*>(data.data() + header.index);
+        // Every lookup must end on an empty slot.
+        uint32_t used = 0;
+        for (uint32_t slot = 0; slot < header.index_slots; slot++) {
+            check(index_[slot] == UINT32_MAX || index_[slot] < header.formulas);
+            used += index_[slot] != UINT32_MAX;
+        }
+        check(used < header.index_slots);
+        code_ = data.data() + header.code;
+        strings_ = data.data() + header.strings;
+        states_.resize(header.formulas, NEW);
+        values_.resize(header.formulas);
+        errors_.resize(header.formulas, ErrorCode::NONE);
+        origins_.resize(header.formulas);
     }
 
-    int divide(int left, int right) const {
-        if ((left <= 0 && right < 0) || (left >= 0 && right > 0)) {
-            return left / right;
-        } else {
-            return -(abs(left) + abs(right) - 1) / abs(right);
+    ~FormulaStore() {
+        if (mapping_) {
+            munmap(mapping_, data_.size());
         }
     }
 
-    Element* proceed(Element* left, Element* right) const {
-        int64_t result = 0;
+    FormulaStore(const FormulaStore&) = delete;
+    FormulaStore& operator=(const FormulaStore&) = delete;
 
-        switch (value_) {
-        case '+':
-            result = left->value() + right->value();
-            break;
-        case '-':
-            result = left->value() - right->value();
-            break;
-        case '*':
-            result = left->value() * right->value();
-            break;
-        case '/':
-            if (right->value() == 0) {
-                throw std::logic_error("Division by zero");
-            }
-            result = divide(left->value(), right->value());
-            break;
-        default:
-            break;
+    static std::unique_ptr<FormulaStore> open(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Cannot open " + path);
         }
+        struct stat status;
+        void* mapping = fstat(fd, &status) == 0 && status.st_size > 0 ?
+            mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            throw std::runtime_error("Cannot map " + path);
+        }
+        std::unique_ptr<FormulaStore> store;
+        try {
+            store = std::make_unique<FormulaStore>(std::string_view(static_cast<const char*>(mapping), status.st_size));
+        } catch (...) {
+            munmap(mapping, status.st_size);
+            throw;
+        }
+        store->mapping_ = mapping;
+        return store;
+    }
 
-        return new Element(result);
+    std::size_t size() const {
+        return header_->formulas;
     }
 
-    int64_t value() const {
-        return value_;
+    int64_t value(std::string_view name) {
+        uint32_t mask = header_->index_slots - 1, formula = UINT32_MAX;
+        for (uint32_t slot = Fingerprint::of(name) & mask; index_[slot] != UINT32_MAX; slot = (slot + 1) & mask) {
+            entry(index_[slot]);
+            if (this->name(index_[slot]) == name) {
+                formula = index_[slot];
+                break;
+            }
+        }
+        if (formula == UINT32_MAX) {
+            throw CalcError(ErrorCode::UNDEFINED_NAME, "Undefined name " + std::string(name));
+        }
+
+        compute(formula);
+        switch (errors_[formula]) {
+            case ErrorCode::NONE:
+                return values_[formula];
+            case ErrorCode::UNDEFINED_NAME:
+                throw CalcError(ErrorCode::UNDEFINED_NAME, "Undefined name " + std::string(this->name(origins_[formula])));
+            default:
+                throw solve_error(errors_[formula]);
+        }
     }
 
-private:
-    int64_t value_;
-    ElementType label_;
-    int priority_;
+    void serve(std::istream &in, std::ostream &out) {
+        std::string line, roman;
+        while (std::getline(in, line)) {
+            std::string_view name = line;
+            while (!name.empty() && is_space(name.front())) {
+                name.remove_prefix(1);
+            }
+            while (!name.empty() && is_space(name.back())) {
+                name.remove_suffix(1);
+            }
+            try {
+                StageTimer timer(Stage::TOTAL);
+                converter.to_roman(value(name), roman);
+                out << roman << std::endl;
+            } catch (std::logic_error &e) {
+                out << "error: " << e.what() << std::endl;
+            }
+            Instrumentation::dump_if_requested(std::cerr);
+        }
+    }
 };
 
 /**
- * @class Expression solver
- * Parses and solves an arithmetic expression.
+ * @class Benchmark
+ * Minimal micro-benchmark runner used by --bench. Every case runs a fixed number of
+ * iterations and reports mean nanoseconds and heap allocations per iteration.
  * 
  * Methods:
- * bool is_roman(const char c) // checks that the current character is a Roman numeral.
- * bool is_operation(const char c) //  checks that the current character is a binary operation.
- * bool is_unary(int current) // checks than an element on a current position can ba an unary minus.
- * int64_t read_number() // reads roman number starting from the current solver's state.
- * ExpressionSolver(std::string expression) // parses given string to a Reverse Polish notation.
- * std::string solve() // solves an expression from a current solver's state.
+ * void run(const std::string &name, int iterations, Function function) // times iterations of function().
  */
-class ExpressionSolver {
+class Benchmark {
 private:
-    std::string data_; // input string for solver.
-    int position_; // current solver's state.
-    const std::vector<char> available_symbols = {'I', 'V', 'X', 'L', 'C', 'D', 'M', 'Z'};
+    std::ostream &out_;
+    volatile int64_t sink_ = 0;
+public:
+    Benchmark(std::ostream &out) : out_(out) {
+        out_ << "benchmark                              ns/op    allocs/op\n";
+    }
+
+    template <class Function>
+    void run(const std::string &name, int iterations, Function function) {
+        uint64_t allocations = AllocationCounter::allocations;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            sink_ = sink_ + function();
+        }
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        out_ << std::left << std::setw(34) << name << std::right << std::fixed << std::setprecision(1)
+             << std::setw(10) << static_cast<double>(elapsed) / iterations << ' '
+             << std::setw(12) << static_cast<double>(AllocationCounter::allocations - allocations) / iterations << std::endl;
+    }
+};
+
+void run_benchmarks(std::ostream &out) {
+    Benchmark benchmark(out);
+    const int iterations = 1000000;
+
+    benchmark.run("solver construction (empty line)", iterations, [] {
+        ExpressionSolver solver("");
+        return solver.compute();
+    });
+    benchmark.run("short line (MCMXC+XIV)", iterations, [] {
+        ExpressionSolver solver("MCMXC+XIV");
+        return solver.solve().size();
+    });
+    ExpressionSolver reused;
+    benchmark.run("reused solver, short line", iterations, [&reused] {
+        return reused.evaluate("MCMXC+XIV").size();
+    });
+    for (const char* line : {"MCMXC", "MCMXC*II"}) {
+        benchmark.run(std::string("fast path, ") + line, iterations, [&reused, line] {
+            return reused.evaluate(line).size();
+        });
+        benchmark.run(std::string("general path, ") + line, iterations, [&reused, line] {
+            reused.reset(line);
+            return reused.solve().size();
+        });
+    }
+    benchmark.run("long line (40 operations)", iterations / 10, [] {
+        ExpressionSolver solver("(MMM-CM)/II/(X+V)-XL+(IV*IX-XC)/(C-L)+MCMXC-(D+CD)/(L-XL)*(X-V)+"
+                                "(MM-M)/C*(X+IX)-CC+(LX-L)*(III+II)-(DCC-D)/(XL+X)+M-(CM-DC)*II");
+        return solver.solve().size();
+    });
+    benchmark.run("reused solver, long line", iterations / 10, [&reused] {
+        return reused.evaluate("(MMM-CM)/II/(X+V)-XL+(IV*IX-XC)/(C-L)+MCMXC-(D+CD)/(L-XL)*(X-V)+"
+                               "(MM-M)/C*(X+IX)-CC+(LX-L)*(III+II)-(DCC-D)/(XL+X)+M-(CM-DC)*II").size();
+    });
+
     RomanConverter converter;
-    std::vector<Element*> stack, out; // out -- Reverse Polish notation representarion array. stack -- some helpful array.
+    std::vector<std::string> numerals;
+    for (int value = 1; value <= 3999; value++) {
+        numerals.push_back(converter.to_roman(value));
+    }
+    // Canonical numerals are all found by the NumeralHash probe, the lenient and the strict way
+    // alike. Additive spellings like IIII miss it and run the character loops, and the Decoder
+    // never uses it.
+    std::vector<std::string> additive;
+    for (int value = 1; value <= 3999; value++) {
+        std::string spelling;
+        int rest = value;
+        for (auto [weight, symbol] : {std::pair(1000, 'M'), std::pair(500, 'D'), std::pair(100, 'C'), std::pair(50, 'L'),
+                                      std::pair(10, 'X'), std::pair(5, 'V'), std::pair(1, 'I')}) {
+            spelling.append(rest / weight, symbol);
+            rest %= weight;
+        }
+        if (spelling != numerals[value - 1]) {
+            additive.push_back(spelling);
+        }
+    }
+    std::size_t next = 0;
+    benchmark.run("hashed decode (1..3999)", iterations, [&] {
+        next = next + 1 == numerals.size() ? 0 : next + 1;
+        return converter.to_int64(numerals[next]);
+    });
+    benchmark.run("automaton decode (1..3999)", iterations, [&] {
+        next = next + 1 == numerals.size() ? 0 : next + 1;
+        RomanConverter::Decoder decoder;
+        for (char literal : numerals[next]) {
+            converter.decode(decoder, literal);
+        }
+        return converter.decoded(decoder, true);
+    });
+    next = 0;
+    benchmark.run("lenient decode, additive spellings", iterations, [&] {
+        next = next + 1 == additive.size() ? 0 : next + 1;
+        return converter.to_int64(additive[next]);
+    });
+    benchmark.run("strict decode, additive spellings", iterations, [&] {
+        next = next + 1 == additive.size() ? 0 : next + 1;
+        return converter.to_int64_strict(additive[next]);
+    });
 
-    bool is_roman(const char c) const {
-        return std::find(available_symbols.begin(), available_symbols.end(), c) != available_symbols.end();
+    std::string spaced;
+    while (spaced.size() < (1 << 16)) {
+        spaced += "MMMDCCCLXXXVIII" + std::string(40, ' ') + "*" + std::string(40, ' ') + "(XIV-IX)" +
+                  std::string(100, ' ') + "+\n" + std::string(30, '\t');
     }
+    spaced += "I";
+    out << "block classifier: " << BlockClassifier::name() << std::endl;
+    benchmark.run("tokenize 64 KB indented expression", iterations / 1000, [&spaced] {
+        Tokenizer tokenizer(spaced);
+        int64_t tokens = 0;
+        while (tokenizer.next().type != TokenType::END) {
+            tokens++;
+        }
+        return tokens;
+    });
 
-    bool is_operation(const char c) const {
-        return c == '+' || c == '-' || c == '*' || c == '/';
+    benchmark.run("fingerprint 64 KB indented", iterations / 1000, [&spaced] {
+        return Fingerprint::of(spaced);
+    });
+    benchmark.run("std::hash of stripped copy", iterations / 1000, [&spaced] {
+        std::string stripped;
+        std::copy_if(spaced.begin(), spaced.end(), std::back_inserter(stripped), [](char c) {
+            return !is_space(c);
+        });
+        return std::hash<std::string>()(stripped);
+    });
+    std::unordered_set<uint64_t> fingerprints;
+    std::size_t lines = 0;
+    for (int left = 1; left <= 3999; left += 3) {
+        for (int right = 1; right <= 3999; right += 5) {
+            for (char operation : {'+', '*'}) {
+                fingerprints.insert(Fingerprint::of(numerals[left - 1] + operation + numerals[right - 1]));
+                lines++;
+            }
+        }
     }
+    out << "fingerprint collisions: " << lines - fingerprints.size() << " in " << lines << " distinct lines" << std::endl;
 
-    bool is_unary(int current) const {
-        return (current + 1 < (int)data_.size() && data_[current + 1] == '(' ||
-                is_roman(data_[current + 1])) && 
-                data_[current] == '-' && 
-                (!current || (current > 0 && 
-                (is_operation(data_[current - 1]) || data_[current - 1] == ')')));
+    std::vector<std::string> shared;
+    for (int i = 1; i <= 1000; i++) {
+        shared.push_back("(MMM-CM)/II/(X+V)-XL+(IV*IX-XC)/(C-L)+MCMXC-(D+CD)/(L-XL)*(X-V)+" + numerals[i % 16]);
     }
+    benchmark.run("1000 lines sharing a prefix, plain", iterations / 1000, [&] {
+        int64_t total = 0;
+        for (const std::string &line : shared) {
+            reused.reset(line);
+            total += reused.compute();
+        }
+        return total;
+    });
+    benchmark.run("1000 lines sharing a prefix, memo", iterations / 1000, [&] {
+        SpanMemo memo;
+        int64_t total = 0;
+        for (const std::string &line : shared) {
+            total += memo.evaluate(line);
+        }
+        return total;
+    });
 
-    int64_t read_number() {
-        std::string result = "";
+    std::string typed;
+    while (typed.size() < (1 << 16)) {
+        typed += "(MMMDCCCLXXXVIII-(XIV*IX))/II+";
+    }
+    typed += "I";
+    IncrementalSolver incremental;
+    incremental.assign(typed);
+    incremental.compute();
+    std::size_t middle = typed.find("XIV", typed.size() / 2) + 1;
+    benchmark.run("keystroke at end of 64 KB, full", iterations / 1000, [&] {
+        typed.back() = typed.back() == 'I' ? 'V' : 'I';
+        reused.reset(typed);
+        return reused.compute();
+    });
+    benchmark.run("keystroke at end, incremental", iterations / 10, [&] {
+        typed.back() = typed.back() == 'I' ? 'V' : 'I';
+        incremental.edit(typed.size() - 1, 1, typed.substr(typed.size() - 1));
+        return incremental.compute();
+    });
+    benchmark.run("keystroke in middle, incremental", iterations / 1000, [&] {
+        typed[middle] = typed[middle] == 'I' ? 'V' : 'I';
+        incremental.edit(middle, 1, typed.substr(middle, 1));
+        return incremental.compute();
+    });
 
-        while (position_ < (int)data_.size() && is_roman(data_[position_])) {
-            result += data_[position_++];
+    FormulaSheet sheet;
+    for (int input = 0; input < 100; input++) {
+        sheet.define("IN" + std::to_string(input), numerals[input]);
+    }
+    auto define_formulas = [&sheet] {
+        for (int formula = 0; formula < 10000; formula++) {
+            sheet.define("F" + std::to_string(formula), "IN" + std::to_string(formula % 100) + "*II+X");
         }
-        return converter.to_int64(result);
+    };
+    define_formulas();
+    int input = 0;
+    benchmark.run("10000 formulas, change an input", iterations / 100, [&] {
+        input = input + 1 == 100 ? 0 : input + 1;
+        return sheet.define("IN" + std::to_string(input), numerals[input]).size();
+    });
+    benchmark.run("10000 formulas, redefine all", 10, [&] {
+        define_formulas();
+        return 0;
+    });
+    std::ostringstream saved;
+    sheet.save(saved);
+    std::string store = saved.str();
+    benchmark.run("10000 formulas, load from store", 1000, [&store] {
+        return FormulaStore(store).value("F5000");
+    });
+
+    std::string frames;
+    const char* shapes[] = {"MCMXC+XIV", "XLII*(III-I)", "MMM/VII-CD", "(IV+IX)*(XL-X)"};
+    for (int i = 0; i < 4096; i++) {
+        std::string expression = shapes[i % 4];
+        uint32_t length = expression.size();
+        frames.append(reinterpret_cast<const char*>(&length), sizeof(length));
+        frames += expression;
+    }
+    for (std::size_t batch : {1, 256}) {
+        BinaryServer server;
+        server.set_batching(batch, 50);
+        benchmark.run("serve 4096 frames, batch " + std::to_string(batch), 100, [&] {
+            std::istringstream in(frames);
+            std::ostringstream responses;
+            server.serve(in, responses);
+            return responses.tellp();
+        });
     }
-public:
-    ExpressionSolver(std::string expression) : data_(expression), position_(0) {
-        data_.erase(std::remove_if(data_.begin(), data_.end(), [](unsigned char x) { return std::isspace(x); }), data_.end());
-        int unarity = 1;
-        while (position_ < (int)data_.size()) {
-            if (is_roman(data_[position_])) {
-                int64_t value = read_number();
-                out.push_back(new Element(value * unarity));
-                position_--;
-            } else if (data_[position_] == '(') {
-                stack.push_back(new Element('(', ElementType::BRACKET));
-            } else if (data_[position_] == ')') {
-                while (!stack.empty() && stack.back()->label() != ElementType::BRACKET) {
-                    out.push_back(stack.back());
-                    stack.pop_back();
-                }
-                if (stack.empty()) {
-                    throw std::logic_error("Invalid bracket sequence in expression");
-                }
 
-                delete stack.back();
-                stack.pop_back();
-            } else if (is_operation(data_[position_])) {
-                if (is_unary(position_)) {
-                    unarity = -1;
-                    position_++;
-                    continue;
-                }
+    std::string chain = "MMMDCCCLXXXVIII*(XIV-IX)";
+    while (chain.size() < (16 << 20)) {
+        chain += "+MMMDCCCLXXXVIII*(XIV-IX)/II-M*(X+IV)";
+    }
+    ExpressionSolver sequential, parallel;
+    sequential.set_threads(1);
+    out << "threads: " << hardware_threads() << std::endl;
+    benchmark.run("parse 16 MB chain, 1 thread", 3, [&] {
+        sequential.reset(chain);
+        return 0;
+    });
+    benchmark.run("parse 16 MB chain, all threads", 3, [&] {
+        parallel.reset(chain);
+        return 0;
+    });
+    benchmark.run("solve 16 MB chain, 1 thread", 3, [&] {
+        return sequential.compute();
+    });
+    benchmark.run("solve 16 MB chain, all threads", 3, [&] {
+        return parallel.compute();
+    });
+    StreamingSolver streaming;
+    benchmark.run("stream 16 MB chain", 3, [&] {
+        std::istringstream in(chain);
+        std::ostringstream result;
+        streaming.serve(in, result);
+        return result.tellp();
+    });
+}
 
-                Element* current = new Element(data_[position_], ElementType::BINARY_OPERATION);
-                while (!stack.empty() && stack.back()->priority() >= current->priority()) {
-                    out.push_back(stack.back());
-                    stack.pop_back();
+/**
+ * Runs the checks of --self-test: every vectorized or table-driven kernel against its plain
+ * counterpart. The BlockClassifier kernels the CPU supports are compared with classify_scalar()
+ * on every byte value at every position of a block and on every length, the NumeralAutomaton and
+ * the NumeralHash with the canonical spellings on every string of up to 7 Roman symbols, and
+ * balance_sse41() with balance_scalar() on every bracket pattern of a vector and on random lines.
+ * Prints a line per check and returns the number of failed checks.
+ */
+int run_self_test(std::ostream &out) {
+    int failed = 0;
+    auto report = [&out, &failed](const std::string &name, uint64_t cases, const std::string &failure) {
+        out << std::left << std::setw(34) << name << std::right;
+        if (failure.empty()) {
+            out << "ok, " << cases << " cases" << std::endl;
+        } else {
+            out << "FAILED on " << failure << std::endl;
+            failed++;
+        }
+    };
+    auto same = [](const CharMasks &left, const CharMasks &right) {
+        return left.space == right.space && left.numeral == right.numeral && left.operation == right.operation &&
+               left.open == right.open && left.close == right.close;
+    };
+    uint64_t random = 0x9E3779B97F4A7C15;
+    auto next = [&random] {
+        random ^= random << 13;
+        random ^= random >> 7;
+        random ^= random << 17;
+        return random;
+    };
+
+    using Kernel = CharMasks (*)(const char* block);
+    std::vector<std::pair<std::string, Kernel>> kernels;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        kernels.push_back({"ssse3", classify_ssse3});
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back({"avx2", classify_avx2});
+    }
+#endif
+    for (const auto &kernel : kernels) {
+        uint64_t cases = 0;
+        std::string failure;
+        char block[64];
+        for (char background : {'X', ' ', '+', '\0'}) {
+            for (int byte = 0; byte < 256 && failure.empty(); byte++) {
+                for (int position = 0; position < 64 && failure.empty(); position++, cases++) {
+                    std::memset(block, background, sizeof(block));
+                    block[position] = static_cast<char>(byte);
+                    if (!same(kernel.second(block), classify_scalar(block, 64))) {
+                        failure = "byte " + std::to_string(byte) + " at " + std::to_string(position);
+                    }
                 }
-                stack.push_back(current);
-            } else {
-                throw std::logic_error("Bad symbol on position " + std::to_string(position_ + 1));
             }
-            unarity = 1;
-            position_++;
         }
-
-        while (!stack.empty()) {
-            if (stack.back()->label() != ElementType::BINARY_OPERATION) {
-                throw std::logic_error("Invalid bracket sequence in expression");
+        for (int round = 0; round < 100000 && failure.empty(); round++, cases++) {
+            for (char &c : block) {
+                c = static_cast<char>(next());
+            }
+            if (!same(kernel.second(block), classify_scalar(block, 64))) {
+                failure = "random block " + std::to_string(round);
             }
-            out.push_back(stack.back());
-            stack.pop_back();
         }
+        report("classifier " + kernel.first, cases, failure);
     }
-    
-    std::string solve() {
-        if (out.empty()) {
-            return "Z";
+    {
+        uint64_t cases = 0;
+        std::string failure;
+        char block[64];
+        for (int round = 0; round < 1000 && failure.empty(); round++) {
+            for (char &c : block) {
+                c = "IVX+-*/() \t$"[next() % 12];
+            }
+            for (std::size_t length = 0; length <= 64 && failure.empty(); length++, cases++) {
+                if (!same(BlockClassifier::classify(block, length), classify_scalar(block, length))) {
+                    failure = "length " + std::to_string(length);
+                }
+            }
         }
+        report(std::string("classifier ") + BlockClassifier::name() + ", short blocks", cases, failure);
+    }
 
-        for (auto element : out) {
-            if (element->label() == ElementType::BINARY_OPERATION) {
-                if (stack.size() < 2) {
-                    throw std::logic_error("Invalid expression format");
+    {
+        RomanConverter converter;
+        std::unordered_map<std::string, int64_t> canonical = {{"Z", 0}};
+        for (int64_t value = 1; value <= 3999; value++) {
+            canonical[converter.to_roman(value)] = value;
+        }
+        uint64_t cases = 0;
+        std::string failure, text;
+        for (std::size_t length = 1; length <= 7 && failure.empty(); length++) {
+            std::vector<int> digits(length, 0);
+            while (failure.empty()) {
+                text.clear();
+                RomanConverter::Decoder decoder;
+                for (int digit : digits) {
+                    text += "IVXLCDMZ"[digit];
+                    converter.decode(decoder, text.back());
                 }
-                auto right = stack.back();
-                stack.pop_back();
-                auto left = stack.back();
-                stack.pop_back();
-
-                if (left->label() != ElementType::VALUE || right->label() != ElementType::VALUE) {
-                    throw std::logic_error("Invalid expression format");
+                auto found = canonical.find(text);
+                int64_t expected = found == canonical.end() ? -1 : found->second;
+                if (converter.decoded(decoder, true) != expected || converter.to_int64_strict(text) != expected ||
+                    converter.canonical_value(text) != expected || converter.to_int64(text) != converter.decoded(decoder, false)) {
+                    failure = text;
                 }
-                try {
-                    stack.push_back(element->proceed(left, right));
-                } catch (std::logic_error &e) {
-                    delete element;
-                    throw e;
+                cases++;
+                std::size_t i = 0;
+                while (i < length && ++digits[i] == 8) {
+                    digits[i++] = 0;
+                }
+                if (i == length) {
+                    break;
                 }
-                delete left;
-                delete right;
-                delete element;
-            } else {
-                stack.push_back(element);
             }
         }
+        report("numeral automaton and hash", cases, failure);
+    }
 
-        if (stack[0]->label() != ElementType::VALUE) {
-            throw std::logic_error("Invalid expression format");
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.1")) {
+        // Both must lead the solver to the same verdict: a scan may stop anywhere once the depth
+        // goes negative, so only a valid and balanced scalar result has to be matched exactly.
+        auto agree = [](std::string_view line) {
+            BracketBalance scalar = balance_scalar(line.data(), line.size(), BracketBalance());
+            BracketBalance vector = balance_sse41(line.data(), line.size());
+            if (!scalar.valid) {
+                return !vector.valid;
+            }
+            if (!scalar.balanced()) {
+                return !vector.valid || !vector.balanced();
+            }
+            return vector.valid && vector.depth == scalar.depth && vector.min_depth == scalar.min_depth &&
+                   vector.max_depth == scalar.max_depth;
+        };
+        uint64_t cases = 0;
+        std::string failure, line;
+        for (int prefix : {0, 1, 8}) {
+            for (uint32_t pattern = 0; pattern < (1 << 16) && failure.empty(); pattern++, cases++) {
+                line.assign(prefix, '(');
+                for (int i = 0; i < 16; i++) {
+                    line += pattern >> i & 1 ? ')' : '(';
+                }
+                line.append(prefix, ')');
+                if (!agree(line)) {
+                    failure = line;
+                }
+            }
         }
-        try {
-            auto result = converter.to_roman(stack[0]->value());
-            delete stack[0];
-            return result;
-        } catch (std::logic_error &e) {
-            throw e;
+        for (int round = 0; round < 200000 && failure.empty(); round++, cases++) {
+            line.resize(next() % 100);
+            const char* alphabet = round % 2 ? "((()))X " : "()X $";
+            for (char &c : line) {
+                c = alphabet[next() % std::strlen(alphabet)];
+            }
+            if (!agree(line)) {
+                failure = line;
+            }
         }
+        for (std::size_t depth : {100, 127, 128, 300}) {
+            line = std::string(depth, '(') + std::string(depth, ')');
+            cases++;
+            if (failure.empty() && !agree(line)) {
+                failure = std::to_string(depth) + " nested brackets";
+            }
+        }
+        report("bracket balance sse4.1", cases, failure);
     }
+#endif
+    return failed;
+}
 
-};
+int main(int argc, char* argv[]) {
+    bool binary = false, strict = false;
+    unsigned threads = hardware_threads(), jobs = 0;
+    bool dedup = false, memo = false, formulas = false, interactive = false, stream = false;
+    std::string compile_store, load_store;
+    std::size_t batch_frames = 1;
+    long batch_window = 50;
+    double max_allocations = -1;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--binary") {
+            binary = true;
+        } else if (arg == "--strict") {
+            strict = true;
+        } else if (arg == "--stats") {
+            Instrumentation::enable_timing();
+            std::signal(SIGUSR1, Instrumentation::request_dump);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = std::stoul(argv[++i]);
+        } else if (arg == "--batch-frames" && i + 1 < argc) {
+            batch_frames = std::stoul(argv[++i]);
+        } else if (arg == "--batch-window" && i + 1 < argc) {
+            batch_window = std::stol(argv[++i]);
+        } else if (arg == "--dedup") {
+            dedup = true;
+        } else if (arg == "--memo") {
+            memo = true;
+        } else if (arg == "--formulas") {
+            formulas = true;
+        } else if (arg == "--interactive") {
+            interactive = true;
+        } else if (arg == "--stream") {
+            stream = true;
+        } else if (arg == "--compile-store" && i + 1 < argc) {
+            compile_store = argv[++i];
+        } else if (arg == "--load-store" && i + 1 < argc) {
+            load_store = argv[++i];
+        } else if (arg == "--jobs" && i + 1 < argc) {
+            jobs = std::max(1ul, std::stoul(argv[++i]));
+        } else if (arg == "--bench") {
+            run_benchmarks(std::cout);
+            return 0;
+        } else if (arg == "--self-test") {
+            return run_self_test(std::cout) ? 1 : 0;
+        } else if (arg == "--alloc-stats") {
+            Instrumentation::enable_allocations();
+            std::signal(SIGUSR1, Instrumentation::request_dump);
+        } else if (arg == "--max-allocs-per-expr" && i + 1 < argc) {
+            Instrumentation::enable_allocations();
+            max_allocations = std::stod(argv[++i]);
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--binary] [--strict] [--stats] [--alloc-stats] [--max-allocs-per-expr N] [--threads N] [--jobs N] [--dedup] [--memo] [--formulas] [--interactive] [--stream] [--compile-store FILE] [--load-store FILE] [--batch-frames N] [--batch-window US] [--bench] [--self-test]" << std::endl;
+            return 1;
+        }
+    }
 
-int main() {
-    std::string s;
-    while (std::getline(std::cin, s)) {
+    TaskPool::configure(jobs ? jobs : threads);
+    if (binary) {
+        std::ios::sync_with_stdio(false);
+        std::cin.tie(nullptr);
+        BinaryServer server(strict);
+        server.set_batching(batch_frames, batch_window);
+        server.serve(std::cin, std::cout);
+    } else if (!compile_store.empty()) {
+        FormulaSheet sheet(strict);
+        std::string s;
+        for (int line = 1; std::getline(std::cin, s); line++) {
+            std::size_t equals = s.find('=');
+            try {
+                if (equals == std::string::npos) {
+                    throw CalcError(ErrorCode::INVALID_FORMAT, "Not a definition");
+                }
+                std::string_view view = s;
+                sheet.define(view.substr(0, equals), view.substr(equals + 1));
+            } catch (std::logic_error &e) {
+                std::cerr << "line " << line << ": error: " << e.what() << std::endl;
+            }
+        }
+        std::ofstream out(compile_store, std::ios::binary);
+        sheet.save(out);
+        if (!out.flush()) {
+            std::cerr << "error: cannot write " << compile_store << std::endl;
+            return 1;
+        }
+    } else if (!load_store.empty()) {
         try {
-            ExpressionSolver solver(s);
-            std::cout << solver.solve() << std::endl;
-        } catch (std::logic_error &e) {
-            std::cout << "error: " << e.what() << std::endl;
+            FormulaStore::open(load_store)->serve(std::cin, std::cout);
+        } catch (std::runtime_error &e) {
+            std::cerr << "error: " << e.what() << std::endl;
+            return 1;
         }
+    } else if (stream) {
+        std::ios::sync_with_stdio(false);
+        StreamingSolver solver(strict);
+        solver.serve(std::cin, std::cout);
+    } else if (interactive) {
+        std::string s;
+        IncrementalSolver solver(strict);
+        while (std::getline(std::cin, s)) {
+            try {
+                StageTimer timer(Stage::TOTAL);
+                solver.assign(s);
+                std::cout << solver.solve() << std::endl;
+            } catch (std::logic_error &e) {
+                std::cout << "error: " << e.what() << std::endl;
+            }
+            Instrumentation::dump_if_requested(std::cerr);
+        }
+    } else if (formulas) {
+        FormulaSheet sheet(strict);
+        sheet.serve(std::cin, std::cout);
+    } else if (jobs || dedup || memo) {
+        BatchEvaluator evaluator(strict, threads);
+        evaluator.set_dedup(dedup);
+        evaluator.set_memo(memo);
+        evaluator.serve(std::cin, std::cout);
+    } else {
+        std::string s;
+        ExpressionSolver solver;
+        solver.set_strict(strict);
+        solver.set_threads(threads);
+        while (std::getline(std::cin, s)) {
+            try {
+                StageTimer timer(Stage::TOTAL);
+                std::cout << solver.evaluate(s) << std::endl;
+            } catch (std::logic_error &e) {
+                std::cout << "error: " << e.what() << std::endl;
+            }
+            Instrumentation::dump_if_requested(std::cerr);
+        }
+    }
+
+    if (Instrumentation::enabled()) {
+        Instrumentation::dump(std::cerr);
+        if (TaskPool::started()) {
+            TaskPool::shared().dump(std::cerr);
+        }
+    }
+    if (max_allocations >= 0 && Instrumentation::allocations_per_expression() > max_allocations) {
+        std::cerr << "error: " << Instrumentation::allocations_per_expression()
+                  << " allocations per expression exceed the limit of " << max_allocations << std::endl;
+        return 2;
     }
     return 0;
 }
\ No newline at end of file